@@ -22,19 +22,53 @@ int main(int argc, const char** argv)
     args_init(&args);
     args_parse(&args, argc, argv);
 
+    if (args->cl_list)
+    {
+        cl_list_devices(args->cl_type);
+        args_free(&args);
+        return 0;
+    }
+
     if (args->no_stdout)
     {
         fclose(stdout);
     }
 
-    image_load(args->img_path_in, &image_in);
+    if (args->raw_width > 0)
+    {
+        image_load_raw(args->img_path_in,
+                       &image_in,
+                       args->raw_width,
+                       args->raw_height,
+                       args->raw_comp);
+    }
+    else
+    {
+        image_load(args->img_path_in, &image_in);
+    }
     kmeans_init(&kmeans, args->cluster_count, args->iter_count, &image_in);
+    kmeans->algo = args->algo;
+    kmeans->mode = args->mode;
+    kmeans->out = args->out;
+    kmeans->tol = args->tol;
+    kmeans->min_changed = args->min_changed;
+    kmeans->schedule = args->schedule;
+    kmeans->chunk = args->chunk;
+    kmeans->autotune = args->autotune;
+    simd_select(args->isa);
 
     if (args->use_gpu)
     {
-        cl_init(&clenv);
+        cl_init(&clenv, args->cl_platform, args->cl_device, args->cl_type);
+        clenv->source_path = args->cl_source_path;
+        clenv->profile_format = args->cl_profile;
+        if (args->cl_zero_copy >= 0) clenv->zero_copy = args->cl_zero_copy;
         kmeans_cluster_gpu(&kmeans, &clenv, &image_in, &image_out);
-        image_write(args->img_path_out, &image_out);
+        image_write(args->img_path_out,
+                    &image_out,
+                    args->thread_count,
+                    args->png_level);
+        cl_profile_report(&clenv);
         cl_free(&clenv);
     }
     else if (args->thread_count > 1)
@@ -42,13 +76,19 @@ int main(int argc, const char** argv)
         kmeans_cluster_multithr(&kmeans, &image_in, args->thread_count);
         kmeans_image_multithr(
             &kmeans, &image_in, &image_out, args->thread_count);
-        image_write(args->img_path_out, &image_out);
+        image_write(args->img_path_out,
+                    &image_out,
+                    args->thread_count,
+                    args->png_level);
     }
     else
     {
         kmeans_cluster(&kmeans, &image_in);
         kmeans_image(&kmeans, &image_in, &image_out);
-        image_write(args->img_path_out, &image_out);
+        image_write(args->img_path_out,
+                    &image_out,
+                    args->thread_count,
+                    args->png_level);
     }
 
     args_free(&args);
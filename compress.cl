@@ -1,54 +1,130 @@
-__kernel void compress(__global uchar* image_in,
-                       __global int* rand_vec,
-                       __global int* kmeans_centroids,
-                       __global int* kmeans_px_centroids,
-                       __global uint* kmeans_group_size,
-                       __global uint* kmeans_rgb_values,
-                       int k,
-                       int iter,
-                       int width,
-                       int height,
-                       int comp)
+// One clustering iteration is kmeans_assign, kmeans_reduce and kmeans_update
+// enqueued in order by the host, which checks for convergence in between.
+// Pixel kernels handle px_per_item pixels per work-item, strided by the global
+// size so neighbouring work-items still read neighbouring pixels.
+// Integer sums make the result independent of how the image is split into
+// work-groups. The global sums are 64-bit, as a cluster of a 4K image can hold
+// more bright pixels than a 32-bit channel sum can count.
+
+// The host builds with -DINT64_ATOMICS when the device has 64-bit atomics.
+// Otherwise work-groups add their sums into -DPARTIALS=<n> slots of 32-bit
+// partial sums, which kmeans_update folds into the 64-bit sums.
+#ifdef INT64_ATOMICS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#endif
+
+#ifndef PARTIALS
+#define PARTIALS 1
+#endif
+
+// kmeans_state holds the changed pixel count of the current iteration, and
+// the largest squared centroid shift.
+#define STATE_CHANGED 0
+#define STATE_SHIFT2 1
+
+// The host builds the program with -DK=<k> and -DCOMP=<channels>, so centroid
+// loops get a constant trip count and pixels a fixed stride. Without them the
+// kernels fall back to the k and comp arguments.
+#ifdef K
+#define KMEANS_K K
+#else
+#define KMEANS_K k
+#endif
+
+#ifdef COMP
+#define KMEANS_COMP COMP
+#else
+#define KMEANS_COMP comp
+#endif
+
+// Labels are stored in the narrowest type that holds k, which the host passes
+// as -DLABEL_T=<type>.
+#ifndef LABEL_T
+#define LABEL_T uchar
+#endif
+
+// Loads the color channels of pixel id, with one vector load when the channel
+// count is known at build time.
+void kmeans_load_px(__global const uchar* image_in,
+                    int id,
+                    int comp,
+                    int* r,
+                    int* g,
+                    int* b)
 {
-    int id = get_global_id(0);
-    if (id > width * height) return;
+#if COMP == 4
+    uchar4 px = vload4(id, image_in);
+    *r = px.x;
+    *g = px.y;
+    *b = px.z;
+#elif COMP == 3
+    uchar3 px = vload3(id, image_in);
+    *r = px.x;
+    *g = px.y;
+    *b = px.z;
+#else
+    *r = image_in[id * KMEANS_COMP + 0];
+    *g = image_in[id * KMEANS_COMP + 1];
+    *b = image_in[id * KMEANS_COMP + 2];
+#endif
+}
 
-    kmeans_rgb_values[id] = 0;
-    kmeans_px_centroids[id] = 0;
+__kernel void kmeans_init(__global const uchar* image_in,
+                          __global const int* rand_vec,
+                          __global int* kmeans_centroids,
+                          __global ulong* kmeans_group_size,
+                          __global ulong* kmeans_rgb_values,
+                          int k,
+                          int comp)
+{
+    int c = get_global_id(0);
+    if (c >= KMEANS_K) return;
 
-    if (id == 0)
-    {
-        for (int i = 0; i < k; i++)
-        {
-            kmeans_group_size[i] = 0;
-            kmeans_centroids[i * 3 + 0] = image_in[rand_vec[i] * comp + 0];
-            kmeans_centroids[i * 3 + 1] = image_in[rand_vec[i] * comp + 1];
-            kmeans_centroids[i * 3 + 2] = image_in[rand_vec[i] * comp + 2];
-        }
-    }
+    int r, g, b;
+    kmeans_load_px(image_in, rand_vec[c], comp, &r, &g, &b);
+    kmeans_centroids[c * 3 + 0] = r;
+    kmeans_centroids[c * 3 + 1] = g;
+    kmeans_centroids[c * 3 + 2] = b;
+    kmeans_group_size[c] = 0;
+    kmeans_rgb_values[c * 3 + 0] = 0;
+    kmeans_rgb_values[c * 3 + 1] = 0;
+    kmeans_rgb_values[c * 3 + 2] = 0;
+}
 
-    barrier(CLK_GLOBAL_MEM_FENCE);
+__kernel void kmeans_assign(__global const uchar* image_in,
+                            __constant int* kmeans_centroids,
+                            __global LABEL_T* kmeans_px_centroids,
+                            __global int* kmeans_state,
+                            int k,
+                            int n,
+                            int comp,
+                            int px_per_item)
+{
+    int changed = 0;
 
-    int it = 0;
-    while (it++ < iter)
+    for (int j = 0; j < px_per_item; j++)
     {
-        // Iterate through each pixel in image.
-        int r_s1 = (int)(image_in[id * comp + 0]);
-        int g_s1 = (int)(image_in[id * comp + 1]);
-        int b_s1 = (int)(image_in[id * comp + 2]);
+        int id = get_global_id(0) + j * get_global_size(0);
+        if (id >= n) break;
+
+        int r_s1, g_s1, b_s1;
+        kmeans_load_px(image_in, id, comp, &r_s1, &g_s1, &b_s1);
 
-        float euclid = FLT_MAX;
-        int group;
+        int euclid = INT_MAX;
+        int group = 0;
 
         // Iterate through each group of k groups.
-        for (int i = 0; i < k; i++)
+#ifdef K
+#pragma unroll
+#endif
+        for (int i = 0; i < KMEANS_K; i++)
         {
             // Find the smallest squared euclid distance to a centroid for
             // this pixel.
             int r = kmeans_centroids[i * 3 + 0] - r_s1;
             int g = kmeans_centroids[i * 3 + 1] - g_s1;
             int b = kmeans_centroids[i * 3 + 2] - b_s1;
-            float e = (float)r * (float)r + (float)g * (float)g + (float)b * (float)b;
+            int e = r * r + g * g + b * b;
             if (e < euclid)
             {
                 euclid = e;
@@ -56,29 +132,153 @@ __kernel void compress(__global uchar* image_in,
             }
         }
 
-        // This pixel now belongs to the group with the nearest centroid.
-        kmeans_px_centroids[id] = group;
+        // This pixel now belongs to the group with the nearest centroid. The
+        // host zeroes the labels first, and counts every pixel as changed in
+        // the first iteration.
+        if (kmeans_px_centroids[id] != group) changed++;
+        kmeans_px_centroids[id] = (LABEL_T)group;
+    }
+
+    if (changed != 0) atomic_add(&kmeans_state[STATE_CHANGED], changed);
+}
+
+// Each work-group sums its pixels into local memory, laid out as k group
+// sizes followed by 3 * k channel sums, and then adds every non-zero sum to
+// the 64-bit global sums, or to its slot of partial sums, with one atomic.
+// Global atomics per work-group are bounded by 4 * k instead of growing with
+// the work-group size. The local sums are 32-bit, which holds the host's cap
+// on pixels per work-group.
+__kernel void kmeans_reduce(__global const uchar* image_in,
+                            __global const LABEL_T* kmeans_px_centroids,
+                            __global ulong* kmeans_group_size,
+                            __global ulong* kmeans_rgb_values,
+                            __local uint* local_sums,
+                            int k,
+                            int n,
+                            int comp,
+                            int px_per_item,
+                            __global uint* kmeans_partials)
+{
+    int lid = get_local_id(0);
+    int lsize = get_local_size(0);
 
-        barrier(CLK_GLOBAL_MEM_FENCE);
+    for (int i = lid; i < 4 * KMEANS_K; i += lsize)
+    {
+        local_sums[i] = 0;
+    }
 
-        // Calculate the new centroid for each pixel group.
-        atomic_add(&kmeans_group_size[kmeans_px_centroids[id]], 1);
-        atomic_add(&kmeans_rgb_values[kmeans_px_centroids[id] * 3 + 0], (uint)(image_in[id * comp + 0]));
-        atomic_add(&kmeans_rgb_values[kmeans_px_centroids[id] * 3 + 1], (uint)(image_in[id * comp + 1]));
-        atomic_add(&kmeans_rgb_values[kmeans_px_centroids[id] * 3 + 2], (uint)(image_in[id * comp + 2]));
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        barrier(CLK_GLOBAL_MEM_FENCE);
+    // Work-items past the end of the image still have to reach the barriers.
+    for (int j = 0; j < px_per_item; j++)
+    {
+        int id = get_global_id(0) + j * get_global_size(0);
+        if (id >= n) break;
 
-        // Average out all the pixel values.
-        if (id == 0)
-        {
-            for (int i = 0; i < k; i++)
-            {
-                if (kmeans_group_size[i] == 0) continue;
-                kmeans_centroids[i * 3 + 0] = kmeans_rgb_values[i * 3 + 0] / kmeans_group_size[i];
-                kmeans_centroids[i * 3 + 1] = kmeans_rgb_values[i * 3 + 1] / kmeans_group_size[i];
-                kmeans_centroids[i * 3 + 2] = kmeans_rgb_values[i * 3 + 2] / kmeans_group_size[i];
-            }
-        }
+        int r, g, b;
+        kmeans_load_px(image_in, id, comp, &r, &g, &b);
+
+        int group = kmeans_px_centroids[id];
+        atomic_inc(&local_sums[group]);
+        atomic_add(&local_sums[KMEANS_K + group * 3 + 0], (uint)r);
+        atomic_add(&local_sums[KMEANS_K + group * 3 + 1], (uint)g);
+        atomic_add(&local_sums[KMEANS_K + group * 3 + 2], (uint)b);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+#ifdef INT64_ATOMICS
+    for (int i = lid; i < KMEANS_K; i += lsize)
+    {
+        uint sum = local_sums[i];
+        if (sum != 0) atom_add(&kmeans_group_size[i], (ulong)sum);
+    }
+
+    for (int i = lid; i < 3 * KMEANS_K; i += lsize)
+    {
+        uint sum = local_sums[KMEANS_K + i];
+        if (sum != 0) atom_add(&kmeans_rgb_values[i], (ulong)sum);
+    }
+#else
+    // Slots share the layout of the local sums.
+    __global uint* partial =
+        kmeans_partials + (get_group_id(0) % PARTIALS) * 4 * KMEANS_K;
+    for (int i = lid; i < 4 * KMEANS_K; i += lsize)
+    {
+        uint sum = local_sums[i];
+        if (sum != 0) atomic_add(&partial[i], sum);
+    }
+#endif
+}
+
+__kernel void kmeans_update(__global int* kmeans_centroids,
+                            __global ulong* kmeans_group_size,
+                            __global ulong* kmeans_rgb_values,
+                            __global int* kmeans_state,
+                            int k,
+                            __global uint* kmeans_partials)
+{
+    int c = get_global_id(0);
+    if (c >= KMEANS_K) return;
+
+#ifndef INT64_ATOMICS
+    for (int p = 0; p < PARTIALS; p++)
+    {
+        __global uint* partial = kmeans_partials + p * 4 * KMEANS_K;
+        kmeans_group_size[c] += partial[c];
+        kmeans_rgb_values[c * 3 + 0] += partial[KMEANS_K + c * 3 + 0];
+        kmeans_rgb_values[c * 3 + 1] += partial[KMEANS_K + c * 3 + 1];
+        kmeans_rgb_values[c * 3 + 2] += partial[KMEANS_K + c * 3 + 2];
+        partial[c] = 0;
+        partial[KMEANS_K + c * 3 + 0] = 0;
+        partial[KMEANS_K + c * 3 + 1] = 0;
+        partial[KMEANS_K + c * 3 + 2] = 0;
+    }
+#endif
+
+    // Average out the pixel values of this group, and reset its sums for the
+    // next iteration.
+    ulong size = kmeans_group_size[c];
+    if (size != 0)
+    {
+        int r = (int)(kmeans_rgb_values[c * 3 + 0] / size);
+        int g = (int)(kmeans_rgb_values[c * 3 + 1] / size);
+        int b = (int)(kmeans_rgb_values[c * 3 + 2] / size);
+        int dr = r - kmeans_centroids[c * 3 + 0];
+        int dg = g - kmeans_centroids[c * 3 + 1];
+        int db = b - kmeans_centroids[c * 3 + 2];
+        atomic_max(&kmeans_state[STATE_SHIFT2], dr * dr + dg * dg + db * db);
+        kmeans_centroids[c * 3 + 0] = r;
+        kmeans_centroids[c * 3 + 1] = g;
+        kmeans_centroids[c * 3 + 2] = b;
+    }
+
+    kmeans_group_size[c] = 0;
+    kmeans_rgb_values[c * 3 + 0] = 0;
+    kmeans_rgb_values[c * 3 + 1] = 0;
+    kmeans_rgb_values[c * 3 + 2] = 0;
+}
+
+// Writes the output image from the labels, as the palette index of each pixel
+// when out_comp is 1, or as the RGB or RGBA color of its centroid.
+__kernel void kmeans_map(__global const LABEL_T* kmeans_px_centroids,
+                         __constant int* kmeans_centroids,
+                         __global uchar* image_out,
+                         int n,
+                         int out_comp)
+{
+    int id = get_global_id(0);
+    if (id >= n) return;
+
+    int group = kmeans_px_centroids[id];
+    if (out_comp == 1)
+    {
+        image_out[id] = (uchar)group;
+        return;
     }
+
+    image_out[id * out_comp + 0] = (uchar)kmeans_centroids[group * 3 + 0];
+    image_out[id * out_comp + 1] = (uchar)kmeans_centroids[group * 3 + 1];
+    image_out[id * out_comp + 2] = (uchar)kmeans_centroids[group * 3 + 2];
+    if (out_comp == 4) image_out[id * 4 + 3] = 255;
 }
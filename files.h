@@ -1,23 +1,13 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-size_t file_read(const char* _pathname, char** buf, size_t bufsiz)
+// Reads the whole file into *buf, growing it as needed, and null terminates
+// it. Returns the number of bytes read, plus one for the terminator.
+size_t file_read(const char* _pathname, char** buf)
 {
-    if (*buf == NULL)
-    {
-        if (bufsiz > BUFSIZ)
-        {
-            bufsiz = BUFSIZ;
-            *buf = (char*)realloc(*buf, bufsiz * sizeof(char));
-        }
-        else
-        {
-            *buf = (char*)realloc(*buf, bufsiz * sizeof(char));
-        }
-    }
-
     FILE* fp;
     if ((fp = fopen(_pathname, "r")) == NULL)
     {
@@ -26,7 +16,27 @@ size_t file_read(const char* _pathname, char** buf, size_t bufsiz)
         exit(1);
     }
 
-    size_t bytes_read = fread(*buf, sizeof(char), bufsiz - 1, fp);
+    size_t bufsiz = BUFSIZ;
+    size_t bytes_read = 0;
+    *buf = (char*)realloc(*buf, bufsiz * sizeof(char));
+
+    while (true)
+    {
+        bytes_read +=
+            fread(*buf + bytes_read, sizeof(char), bufsiz - bytes_read - 1, fp);
+        if (bytes_read < bufsiz - 1) break;
+
+        bufsiz *= 2;
+        *buf = (char*)realloc(*buf, bufsiz * sizeof(char));
+    }
+
+    if (ferror(fp))
+    {
+        perror("error reading file");
+        fclose(fp);
+        free(*buf);
+        exit(1);
+    }
 
     (*buf)[bytes_read] = '\0';
 
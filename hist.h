@@ -0,0 +1,255 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#define HIST_INITIAL_CAPACITY (1 << 16)
+#define HIST_HASH_MUL 0x9E3779B1u
+
+// A table of weighted colors built from an image. Each entry has a color used
+// for distance computations, the number of pixels it stands for and the sum of
+// their values, so clustering over entries gives the same centroids as
+// clustering over the pixels. Entries are either exact colors, or the bins of
+// a color cube with 2^bits levels per channel.
+typedef struct hist_t
+{
+    int bits;
+    int size;
+    int capacity;
+    int capacity_log2;
+    int* slots;
+    uint32_t* keys;
+    uint8_t* colors;
+    uint32_t* counts;
+    uint64_t* sums;
+} hist_t;
+
+hist_t* hist_init(hist_t** hist, image_t** img);
+hist_t* hist_init_cube(hist_t** hist, image_t** img, int bits);
+int hist_find(hist_t** hist, uint8_t r, uint8_t g, uint8_t b);
+void hist_free(hist_t** hist);
+static inline uint32_t hist_key(uint8_t r, uint8_t g, uint8_t b);
+static inline uint32_t hist_cube_key(int bits, uint8_t r, uint8_t g, uint8_t b);
+static inline int hist_slot(hist_t* hist, uint32_t key);
+static void hist_grow(hist_t* hist);
+
+hist_t* hist_init(hist_t** hist, image_t** img)
+{
+    assert(*img != NULL);
+
+    if (*hist == NULL)
+    {
+        *hist = (hist_t*)realloc(*hist, sizeof(hist_t));
+    }
+
+    printf("begin color table build...\n");
+
+    // Open addressing with linear probing, kept at most half full. Entries
+    // live in dense arrays in first-seen order, slots index into them.
+    (*hist)->bits = 0;
+    (*hist)->size = 0;
+    (*hist)->capacity = HIST_INITIAL_CAPACITY;
+    (*hist)->capacity_log2 = 16;
+    (*hist)->slots = (int*)malloc((*hist)->capacity * sizeof(int));
+    memset((*hist)->slots, -1, (*hist)->capacity * sizeof(int));
+    (*hist)->keys =
+        (uint32_t*)malloc((*hist)->capacity / 2 * sizeof(uint32_t));
+    (*hist)->colors = (uint8_t*)malloc((*hist)->capacity / 2 * 3);
+    (*hist)->counts =
+        (uint32_t*)malloc((*hist)->capacity / 2 * sizeof(uint32_t));
+    (*hist)->sums =
+        (uint64_t*)malloc((*hist)->capacity / 2 * 3 * sizeof(uint64_t));
+
+    for (int i = 0; i < (*img)->size_pixels; i++)
+    {
+        const uint8_t* px = (*img)->DATA + i * (*img)->comp;
+        uint32_t key = hist_key(px[0], px[1], px[2]);
+
+        int slot = hist_slot(*hist, key);
+        int e = (*hist)->slots[slot];
+        if (e < 0)
+        {
+            if (2 * ((*hist)->size + 1) > (*hist)->capacity)
+            {
+                hist_grow(*hist);
+                slot = hist_slot(*hist, key);
+            }
+
+            e = (*hist)->size++;
+            (*hist)->slots[slot] = e;
+            (*hist)->keys[e] = key;
+            (*hist)->colors[e * 3 + 0] = px[0];
+            (*hist)->colors[e * 3 + 1] = px[1];
+            (*hist)->colors[e * 3 + 2] = px[2];
+            (*hist)->counts[e] = 0;
+            (*hist)->sums[e * 3 + 0] = 0;
+            (*hist)->sums[e * 3 + 1] = 0;
+            (*hist)->sums[e * 3 + 2] = 0;
+        }
+
+        (*hist)->counts[e]++;
+        (*hist)->sums[e * 3 + 0] += px[0];
+        (*hist)->sums[e * 3 + 1] += px[1];
+        (*hist)->sums[e * 3 + 2] += px[2];
+    }
+
+    printf("end color table build...\n");
+    printf("color table has %d entries for %d pixels, %f MB\n",
+           (*hist)->size,
+           (*img)->size_pixels,
+           (double)((*hist)->capacity * sizeof(int) +
+                    (*hist)->capacity / 2 *
+                        (sizeof(uint32_t) * 2 + 3 + 3 * sizeof(uint64_t))) /
+               1e6);
+
+    return (*hist);
+}
+
+hist_t* hist_init_cube(hist_t** hist, image_t** img, int bits)
+{
+    assert(*img != NULL);
+    assert(bits > 0 && bits <= 8);
+
+    if (*hist == NULL)
+    {
+        *hist = (hist_t*)realloc(*hist, sizeof(hist_t));
+    }
+
+    printf("begin %d-bit color cube build...\n", bits);
+
+    // Every bin has a fixed slot, so no hashing is needed. The entry arrays
+    // hold only the occupied bins, in bin order.
+    const int bins = 1 << (3 * bits);
+    (*hist)->bits = bits;
+    (*hist)->size = 0;
+    (*hist)->capacity = bins;
+    (*hist)->capacity_log2 = 3 * bits;
+    (*hist)->slots = (int*)malloc(bins * sizeof(int));
+
+    uint32_t* counts = (uint32_t*)calloc(bins, sizeof(uint32_t));
+    uint64_t* sums = (uint64_t*)calloc(3 * bins, sizeof(uint64_t));
+
+    for (int i = 0; i < (*img)->size_pixels; i++)
+    {
+        const uint8_t* px = (*img)->DATA + i * (*img)->comp;
+        uint32_t key = hist_cube_key(bits, px[0], px[1], px[2]);
+
+        counts[key]++;
+        sums[key * 3 + 0] += px[0];
+        sums[key * 3 + 1] += px[1];
+        sums[key * 3 + 2] += px[2];
+    }
+
+    for (int b = 0; b < bins; b++)
+    {
+        (*hist)->slots[b] = counts[b] > 0 ? (*hist)->size++ : -1;
+    }
+
+    const int size = (*hist)->size;
+    (*hist)->keys = (uint32_t*)malloc(size * sizeof(uint32_t));
+    (*hist)->colors = (uint8_t*)malloc(size * 3);
+    (*hist)->counts = (uint32_t*)malloc(size * sizeof(uint32_t));
+    (*hist)->sums = (uint64_t*)malloc(size * 3 * sizeof(uint64_t));
+
+    // Distances are measured to the mean color of each bin.
+    for (int b = 0; b < bins; b++)
+    {
+        int e = (*hist)->slots[b];
+        if (e < 0) continue;
+
+        (*hist)->keys[e] = (uint32_t)b;
+        (*hist)->counts[e] = counts[b];
+        for (int ch = 0; ch < 3; ch++)
+        {
+            (*hist)->sums[e * 3 + ch] = sums[b * 3 + ch];
+            (*hist)->colors[e * 3 + ch] =
+                (uint8_t)((sums[b * 3 + ch] + counts[b] / 2) / counts[b]);
+        }
+    }
+
+    free(counts);
+    free(sums);
+
+    printf("end color cube build...\n");
+    printf("color cube has %d occupied of %d bins for %d pixels\n",
+           size,
+           bins,
+           (*img)->size_pixels);
+
+    return (*hist);
+}
+
+int hist_find(hist_t** hist, uint8_t r, uint8_t g, uint8_t b)
+{
+    assert(*hist != NULL);
+
+    if ((*hist)->bits > 0)
+    {
+        return (*hist)->slots[hist_cube_key((*hist)->bits, r, g, b)];
+    }
+
+    return (*hist)->slots[hist_slot(*hist, hist_key(r, g, b))];
+}
+
+void hist_free(hist_t** hist)
+{
+    assert(*hist != NULL);
+
+    free((*hist)->slots);
+    free((*hist)->keys);
+    free((*hist)->colors);
+    free((*hist)->counts);
+    free((*hist)->sums);
+    free(*hist);
+}
+
+static inline uint32_t hist_key(uint8_t r, uint8_t g, uint8_t b)
+{
+    return (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)b;
+}
+
+static inline uint32_t hist_cube_key(int bits, uint8_t r, uint8_t g, uint8_t b)
+{
+    const int shift = 8 - bits;
+    return (uint32_t)(r >> shift) << (2 * bits) |
+           (uint32_t)(g >> shift) << bits | (uint32_t)(b >> shift);
+}
+
+static inline int hist_slot(hist_t* hist, uint32_t key)
+{
+    uint32_t mask = (uint32_t)hist->capacity - 1;
+    uint32_t slot = (key * HIST_HASH_MUL) >> (32 - hist->capacity_log2);
+
+    while (hist->slots[slot] >= 0 && hist->keys[hist->slots[slot]] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return (int)slot;
+}
+
+static void hist_grow(hist_t* hist)
+{
+    hist->capacity *= 2;
+    hist->capacity_log2++;
+
+    hist->slots = (int*)realloc(hist->slots, hist->capacity * sizeof(int));
+    memset(hist->slots, -1, hist->capacity * sizeof(int));
+    hist->keys = (uint32_t*)realloc(hist->keys,
+                                    hist->capacity / 2 * sizeof(uint32_t));
+    hist->colors = (uint8_t*)realloc(hist->colors, hist->capacity / 2 * 3);
+    hist->counts = (uint32_t*)realloc(hist->counts,
+                                      hist->capacity / 2 * sizeof(uint32_t));
+    hist->sums = (uint64_t*)realloc(hist->sums,
+                                    hist->capacity / 2 * 3 * sizeof(uint64_t));
+
+    for (int e = 0; e < hist->size; e++)
+    {
+        hist->slots[hist_slot(hist, hist->keys[e])] = e;
+    }
+}
@@ -1,13 +1,30 @@
 #pragma once
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+
+#include "png.h"
+
+// Where DATA was allocated, so it is released the same way.
+typedef enum image_owner_t
+{
+    IMAGE_OWNER_STB,
+    IMAGE_OWNER_MALLOC,
+    IMAGE_OWNER_MMAP,
+    // DATA is borrowed, and left to whoever lent it.
+    IMAGE_OWNER_NONE
+} image_owner_t;
 
 typedef struct image_t
 {
@@ -17,12 +34,44 @@ typedef struct image_t
     int size_pixels;
     int size_bytes;
     uint8_t* DATA;
+    // Single channel images with a palette hold palette indices, and are
+    // written as indexed-color PNGs. Entries are RGBA in memory order.
+    uint32_t* palette;
+    int palette_size;
+    image_owner_t owner;
+    // Mapped images have DATA point into this mapping of the whole file.
+    uint8_t* map;
+    size_t map_size;
 } image_t;
 
 image_t* image_load(const char* _pathname, image_t** image);
-void image_write(const char* _pathname, image_t** image);
+image_t* image_load_raw(const char* _pathname,
+                        image_t** image,
+                        int width,
+                        int height,
+                        int comp);
+void image_write(const char* _pathname,
+                 image_t** image,
+                 int threads,
+                 int level);
+void image_free_data(image_t** image);
 void image_free(image_t** image);
+uint8_t* image_map(const char* _pathname, size_t* size);
+void image_loaded(image_t** image, const char* _format);
+void image_expand_gray(image_t** image);
+bool image_size_valid(int width, int height, int comp);
+bool image_parse_pnm(image_t** image);
+bool image_parse_pam(image_t** image);
+bool image_decode_qoi(image_t** image);
+bool image_header_token(const uint8_t* _buf,
+                        size_t size,
+                        size_t* pos,
+                        char* token,
+                        size_t token_size);
 
+// Picks the decoder from the first bytes of the file. 8-bit PPM, PGM and PAM
+// images are used in place in the file mapping, QOI is decoded from it, and
+// anything else goes through stb_image.
 image_t* image_load(const char* _pathname, image_t** image)
 {
     if (*image == NULL)
@@ -33,40 +82,130 @@ image_t* image_load(const char* _pathname, image_t** image)
     printf("image: %s\n", _pathname);
     printf("begin image load...\n");
 
-    (*image)->DATA = stbi_load(
-        _pathname, &(*image)->width, &(*image)->height, &(*image)->comp, 0);
+    (*image)->palette = NULL;
+    (*image)->palette_size = 0;
+    (*image)->map = image_map(_pathname, &(*image)->map_size);
 
-    assert((*image)->DATA != NULL);
+    const uint8_t* map = (*image)->map;
+    const size_t size = (*image)->map_size;
+    const char* format = NULL;
 
-    (*image)->size_pixels = (*image)->width * (*image)->height;
-    (*image)->size_bytes = (*image)->size_pixels * (*image)->comp;
+    if (size >= 2 && map[0] == 'P' && (map[1] == '5' || map[1] == '6'))
+    {
+        if (image_parse_pnm(image)) format = "pnm";
+    }
+    else if (size >= 3 && memcmp(map, "P7\n", 3) == 0)
+    {
+        if (image_parse_pam(image)) format = "pam";
+    }
+    else if (size >= 4 && memcmp(map, "qoif", 4) == 0)
+    {
+        if (image_decode_qoi(image)) format = "qoi";
+    }
 
-    printf("end image load...\n");
-    printf("image is %dx%dpx, %d ch, %d pixels, %f MB raw\n",
-           (*image)->width,
-           (*image)->height,
-           (*image)->comp,
-           (*image)->size_pixels,
-           (double)(*image)->size_bytes / 1e6);
+    if (format == NULL)
+    {
+        format = "stb";
+        (*image)->owner = IMAGE_OWNER_STB;
+        (*image)->DATA = stbi_load_from_memory(map,
+                                               (int)size,
+                                               &(*image)->width,
+                                               &(*image)->height,
+                                               &(*image)->comp,
+                                               0);
+    }
+
+    if ((*image)->DATA == NULL)
+    {
+        fprintf(stderr,
+                "error reading image: %s: %s\n",
+                _pathname,
+                stbi_failure_reason());
+        exit(1);
+    }
+
+    image_loaded(image, format);
 
     return (*image);
 }
 
-void image_write(const char* _pathname, image_t** image)
+// Uses a headerless file of width * height pixels of comp channels in place.
+image_t* image_load_raw(const char* _pathname,
+                        image_t** image,
+                        int width,
+                        int height,
+                        int comp)
+{
+    assert(width > 0 && height > 0);
+    assert(comp >= 1 && comp <= 4);
+
+    if (!image_size_valid(width, height, comp))
+    {
+        fprintf(stderr,
+                "error reading image: %dx%dx%d is too large\n",
+                width,
+                height,
+                comp);
+        exit(1);
+    }
+
+    if (*image == NULL)
+    {
+        *image = (image_t*)realloc(*image, sizeof(image_t));
+    }
+
+    printf("image: %s\n", _pathname);
+    printf("begin image load...\n");
+
+    (*image)->palette = NULL;
+    (*image)->palette_size = 0;
+    (*image)->map = image_map(_pathname, &(*image)->map_size);
+
+    if ((*image)->map_size < (size_t)width * height * comp)
+    {
+        fprintf(stderr,
+                "error reading image: %zu bytes is too small for %dx%dx%d\n",
+                (*image)->map_size,
+                width,
+                height,
+                comp);
+        exit(1);
+    }
+
+    (*image)->width = width;
+    (*image)->height = height;
+    (*image)->comp = comp;
+    (*image)->DATA = (*image)->map;
+    (*image)->owner = IMAGE_OWNER_MMAP;
+
+    image_loaded(image, "raw");
+
+    return (*image);
+}
+
+// Encodes the image as a PNG with threads threads, at deflate level 0 to 9.
+void image_write(const char* _pathname,
+                 image_t** image,
+                 int threads,
+                 int level)
 {
     assert(*image != NULL);
+    assert((*image)->palette == NULL || (*image)->comp == 1);
 
     printf("image out: %s\n", _pathname);
     printf("begin image write...\n");
 
-    int ret = stbi_write_png(_pathname,
-                             (*image)->width,
-                             (*image)->height,
-                             (*image)->comp,
-                             (*image)->DATA,
-                             (*image)->width * (*image)->comp);
+    int ret = png_write(_pathname,
+                        (*image)->width,
+                        (*image)->height,
+                        (*image)->comp,
+                        (*image)->DATA,
+                        (*image)->palette,
+                        (*image)->palette_size,
+                        level,
+                        threads);
 
-    if (ret < 0)
+    if (ret == 0)
     {
         fprintf(stderr, "error writing image\n");
     }
@@ -80,10 +219,345 @@ void image_write(const char* _pathname, image_t** image)
            (double)(*image)->size_bytes / 1e6);
 }
 
+// Releases DATA, and the file mapping behind it if any.
+void image_free_data(image_t** image)
+{
+    assert(*image != NULL);
+
+    switch ((*image)->owner)
+    {
+    case IMAGE_OWNER_STB:
+        stbi_image_free((*image)->DATA);
+        break;
+    case IMAGE_OWNER_MALLOC:
+        free((*image)->DATA);
+        break;
+    case IMAGE_OWNER_MMAP:
+        munmap((*image)->map, (*image)->map_size);
+        break;
+    case IMAGE_OWNER_NONE:
+        break;
+    }
+
+    (*image)->DATA = NULL;
+    (*image)->map = NULL;
+    (*image)->map_size = 0;
+}
+
 void image_free(image_t** image)
 {
     assert(*image != NULL);
 
-    stbi_image_free((*image)->DATA);
+    image_free_data(image);
+    free((*image)->palette);
     free(*image);
 }
+
+// Maps the whole file. The pages are private, so writes to them stay in
+// memory, and are only copied when written.
+uint8_t* image_map(const char* _pathname, size_t* size)
+{
+    int fd = open(_pathname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror("error reading image");
+        exit(1);
+    }
+
+    if (st.st_size == 0)
+    {
+        fprintf(stderr, "error reading image: %s is empty\n", _pathname);
+        exit(1);
+    }
+
+    void* map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        perror("error reading image");
+        exit(1);
+    }
+
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    *size = st.st_size;
+    return (uint8_t*)map;
+}
+
+// Expands gray images, drops the file mapping unless DATA points into it, and
+// prints the image.
+void image_loaded(image_t** image, const char* _format)
+{
+    if ((*image)->comp < 3) image_expand_gray(image);
+
+    if ((*image)->owner != IMAGE_OWNER_MMAP)
+    {
+        munmap((*image)->map, (*image)->map_size);
+        (*image)->map = NULL;
+        (*image)->map_size = 0;
+    }
+
+    (*image)->size_pixels = (*image)->width * (*image)->height;
+    (*image)->size_bytes = (*image)->size_pixels * (*image)->comp;
+
+    printf("end image load...\n");
+    printf("image is %dx%dpx, %d ch, %d pixels, %f MB raw, %s%s\n",
+           (*image)->width,
+           (*image)->height,
+           (*image)->comp,
+           (*image)->size_pixels,
+           (double)(*image)->size_bytes / 1e6,
+           _format,
+           (*image)->owner == IMAGE_OWNER_MMAP ? " mapped" : "");
+}
+
+// Clustering reads three color channels per pixel, so gray and gray with
+// alpha become RGB and RGBA. A mapping DATA pointed into is left for
+// image_loaded to drop.
+void image_expand_gray(image_t** image)
+{
+    const int comp = (*image)->comp;
+    const size_t pixels = (size_t)(*image)->width * (*image)->height;
+    const uint8_t* src = (*image)->DATA;
+
+    uint8_t* data = (uint8_t*)malloc(pixels * (comp + 2));
+    if (data == NULL)
+    {
+        fprintf(stderr, "error reading image: out of memory\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+        uint8_t* px = &data[i * (comp + 2)];
+        px[0] = px[1] = px[2] = src[i * comp];
+        if (comp == 2) px[3] = src[i * 2 + 1];
+    }
+
+    if ((*image)->owner == IMAGE_OWNER_STB)
+        stbi_image_free((*image)->DATA);
+    else if ((*image)->owner == IMAGE_OWNER_MALLOC)
+        free((*image)->DATA);
+
+    (*image)->DATA = data;
+    (*image)->comp = comp + 2;
+    (*image)->owner = IMAGE_OWNER_MALLOC;
+}
+
+// Images are indexed with ints, gray ones after they become RGB or RGBA.
+bool image_size_valid(int width, int height, int comp)
+{
+    return width > 0 && height > 0 &&
+           (uint64_t)width * height * (comp < 3 ? comp + 2 : comp) <= INT_MAX;
+}
+
+// Binary PPM and PGM with a maxval of 255. Others are left to stb_image.
+bool image_parse_pnm(image_t** image)
+{
+    const uint8_t* map = (*image)->map;
+    const size_t size = (*image)->map_size;
+    size_t pos = 2;
+    char token[3][16];
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (!image_header_token(map, size, &pos, token[i], sizeof(token[i])))
+            return false;
+    }
+
+    int width = atoi(token[0]);
+    int height = atoi(token[1]);
+    int comp = map[1] == '5' ? 1 : 3;
+
+    // A single whitespace character separates the header from the pixels.
+    pos++;
+    if (!image_size_valid(width, height, comp) || atoi(token[2]) != 255 ||
+        size - pos < (size_t)width * height * comp)
+        return false;
+
+    (*image)->width = width;
+    (*image)->height = height;
+    (*image)->comp = comp;
+    (*image)->DATA = (*image)->map + pos;
+    (*image)->owner = IMAGE_OWNER_MMAP;
+
+    return true;
+}
+
+// PAM with a depth of 1 to 4 and a maxval of 255. The tuple type is ignored,
+// the depth alone gives the channel count.
+bool image_parse_pam(image_t** image)
+{
+    const uint8_t* map = (*image)->map;
+    const size_t size = (*image)->map_size;
+    size_t pos = 3;
+    int width = 0, height = 0, comp = 0, maxval = 0;
+    char token[32], value[32];
+
+    while (true)
+    {
+        if (!image_header_token(map, size, &pos, token, sizeof(token)))
+            return false;
+        if (strcmp(token, "ENDHDR") == 0) break;
+        if (!image_header_token(map, size, &pos, value, sizeof(value)))
+            return false;
+
+        if (strcmp(token, "WIDTH") == 0)
+            width = atoi(value);
+        else if (strcmp(token, "HEIGHT") == 0)
+            height = atoi(value);
+        else if (strcmp(token, "DEPTH") == 0)
+            comp = atoi(value);
+        else if (strcmp(token, "MAXVAL") == 0)
+            maxval = atoi(value);
+        else if (strcmp(token, "TUPLTYPE") != 0)
+            return false;
+    }
+
+    // ENDHDR ends with a newline.
+    pos++;
+    if (comp < 1 || comp > 4 || !image_size_valid(width, height, comp) ||
+        maxval != 255 || size - pos < (size_t)width * height * comp)
+        return false;
+
+    (*image)->width = width;
+    (*image)->height = height;
+    (*image)->comp = comp;
+    (*image)->DATA = (*image)->map + pos;
+    (*image)->owner = IMAGE_OWNER_MMAP;
+
+    return true;
+}
+
+// Decodes a QOI image, see https://qoiformat.org/qoi-specification.pdf.
+bool image_decode_qoi(image_t** image)
+{
+    const uint8_t* map = (*image)->map;
+    const size_t size = (*image)->map_size;
+
+    // A 14 byte header, and 7 zero bytes and a one after the last chunk.
+    if (size < 14 + 8) return false;
+
+    uint32_t w = ((uint32_t)map[4] << 24) | ((uint32_t)map[5] << 16) |
+                 ((uint32_t)map[6] << 8) | map[7];
+    uint32_t h = ((uint32_t)map[8] << 24) | ((uint32_t)map[9] << 16) |
+                 ((uint32_t)map[10] << 8) | map[11];
+    int comp = map[12];
+    if (w > INT_MAX || h > INT_MAX || (comp != 3 && comp != 4) ||
+        !image_size_valid((int)w, (int)h, comp))
+        return false;
+
+    int width = (int)w;
+    int height = (int)h;
+    uint8_t* data = (uint8_t*)malloc((size_t)width * height * comp);
+    if (data == NULL)
+    {
+        fprintf(stderr, "error reading image: out of memory\n");
+        exit(1);
+    }
+
+    uint8_t index[64][4];
+    memset(index, 0, sizeof(index));
+    uint8_t px[4] = {0, 0, 0, 255};
+    int run = 0;
+
+    const size_t end = size - 8;
+    size_t pos = 14;
+    for (size_t i = 0; i < (size_t)width * height; i++)
+    {
+        if (run > 0)
+        {
+            run--;
+        }
+        else if (pos < end)
+        {
+            int b1 = map[pos++];
+            if (b1 == 0xfe)
+            {
+                memcpy(px, &map[pos], 3);
+                pos += 3;
+            }
+            else if (b1 == 0xff)
+            {
+                memcpy(px, &map[pos], 4);
+                pos += 4;
+            }
+            else if ((b1 & 0xc0) == 0x00)
+            {
+                memcpy(px, index[b1], 4);
+            }
+            else if ((b1 & 0xc0) == 0x40)
+            {
+                px[0] += ((b1 >> 4) & 0x03) - 2;
+                px[1] += ((b1 >> 2) & 0x03) - 2;
+                px[2] += (b1 & 0x03) - 2;
+            }
+            else if ((b1 & 0xc0) == 0x80)
+            {
+                int b2 = map[pos++];
+                int dg = (b1 & 0x3f) - 32;
+                px[0] += dg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += dg;
+                px[2] += dg - 8 + (b2 & 0x0f);
+            }
+            else
+            {
+                run = b1 & 0x3f;
+            }
+
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64],
+                   px,
+                   4);
+        }
+
+        memcpy(&data[i * comp], px, comp);
+    }
+
+    (*image)->width = width;
+    (*image)->height = height;
+    (*image)->comp = comp;
+    (*image)->DATA = data;
+    (*image)->owner = IMAGE_OWNER_MALLOC;
+
+    return true;
+}
+
+// Reads the next whitespace separated header token, skipping comments, and
+// leaves pos at the whitespace after it.
+bool image_header_token(const uint8_t* _buf,
+                        size_t size,
+                        size_t* pos,
+                        char* token,
+                        size_t token_size)
+{
+    while (*pos < size)
+    {
+        if (_buf[*pos] == '#')
+        {
+            while (*pos < size && _buf[*pos] != '\n') (*pos)++;
+        }
+        else if (_buf[*pos] == ' ' || _buf[*pos] == '\t' ||
+                 _buf[*pos] == '\n' || _buf[*pos] == '\r')
+        {
+            (*pos)++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    size_t len = 0;
+    while (*pos < size && _buf[*pos] != ' ' && _buf[*pos] != '\t' &&
+           _buf[*pos] != '\n' && _buf[*pos] != '\r')
+    {
+        if (len + 1 == token_size) return false;
+        token[len++] = (char)_buf[(*pos)++];
+    }
+
+    token[len] = '\0';
+    return len > 0 && *pos < size;
+}
@@ -2,15 +2,24 @@
 
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <omp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "files.h"
+#include "hist.h"
 #include "image.h"
 #include "ocl.h"
+#include "simd.h"
+
+#ifdef KMEANS_EMBED_CL
+#include "compress_cl.h"
+#endif
 
 typedef struct kmean_sample_t
 {
@@ -19,22 +28,149 @@ typedef struct kmean_sample_t
     int b;
 } kmean_sample_t;
 
+// Pixels handed to the SIMD assignment kernel per OpenMP work item.
+#define KMEANS_SIMD_BLOCK 1024
+
+// Per-thread partial sums are padded to whole cache lines of this size.
+#define KMEANS_CACHE_LINE 64
+
+// Pixels per work-item the GPU autotuner tries, as powers of two, and how
+// many times it times every candidate.
+#define KMEANS_TUNE_MAX_PX_PER_ITEM 16
+#define KMEANS_TUNE_RUNS 3
+
+// kmeans_reduce sums a work-group's pixels in 32-bit local memory, so a
+// work-group may cover at most this many pixels of 255 per channel.
+#define KMEANS_CL_MAX_GROUP_PX (UINT32_MAX / 255)
+
+// Slots of 32-bit partial sums kmeans_reduce adds into on devices without
+// 64-bit atomics, work-group g into slot g % KMEANS_CL_PARTIALS. A slot covers
+// at most n / KMEANS_CL_PARTIALS pixels plus one work-group, which fits
+// KMEANS_CL_MAX_GROUP_PX for any int n while work-groups cover at most half.
+#define KMEANS_CL_PARTIALS 256
+
+// Slack added to the Elkan and Hamerly bounds on every update, so that float
+// rounding can never make a bound tighter than the true distance.
+#define KMEANS_BOUND_EPS 1e-3f
+
+typedef enum kmean_algo_t
+{
+    KMEANS_ALGO_LLOYD,
+    KMEANS_ALGO_ELKAN,
+    KMEANS_ALGO_HAMERLY,
+} kmean_algo_t;
+
+typedef enum kmean_mode_t
+{
+    KMEANS_MODE_PIXEL,
+    KMEANS_MODE_HIST,
+    KMEANS_MODE_CUBE5,
+    KMEANS_MODE_CUBE6,
+} kmean_mode_t;
+
+// Pixel format of the output image. Index writes the palette index of each
+// pixel as one byte, and keeps the centroids as the image palette.
+typedef enum kmean_out_t
+{
+    KMEANS_OUT_RGBA,
+    KMEANS_OUT_RGB,
+    KMEANS_OUT_INDEX,
+} kmean_out_t;
+
+// How a pixel kernel is launched on the GPU.
+typedef struct kmean_cl_launch_t
+{
+    size_t local_size;
+    int px_per_item;
+} kmean_cl_launch_t;
+
 typedef struct kmean_t
 {
     int k;
     int iter;
-    int* px_centroid;
+    int iter_done;
+    // Clustering stops early once no centroid moved more than tol, or at
+    // most a min_changed fraction of pixels changed cluster. Negative values
+    // disable either test.
+    double tol;
+    double min_changed;
+    kmean_algo_t algo;
+    kmean_mode_t mode;
+    kmean_out_t out;
+    // OpenMP schedule of the pixel loop in multithreaded lloyd, a chunk is
+    // one block of KMEANS_SIMD_BLOCK pixels. Chunk 0 uses the default.
+    omp_sched_t schedule;
+    int chunk;
+    // Time the GPU kernel launch shapes before clustering, and save the
+    // fastest for later runs.
+    bool autotune;
+    // Centroid of each pixel, in the narrowest type that holds k.
+    simd_label_t* px_centroid;
     kmean_sample_t* centroids;
+
+    // Color table and the centroid of each of its entries, when clustering
+    // over a histogram instead of raw pixels.
+    hist_t* hist;
+    int* hist_centroid;
+
+    // Pixel-to-centroid distance evaluations done during clustering, and how
+    // many a full lloyd scan would have done.
+    uint64_t dist_evals;
+    uint64_t dist_total;
 } kmean_t;
 
 kmean_t* kmeans_init(kmean_t** kmn, int k, int iter, image_t** img);
+kmean_t* kmeans_seed(kmean_t** kmn, image_t** img);
 kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img);
 kmean_t* kmeans_cluster_multithr(kmean_t** kmn, image_t** img_in, int threads);
+kmean_t* kmeans_cluster_elkan(kmean_t** kmn, image_t** img, int threads);
+kmean_t* kmeans_cluster_hamerly(kmean_t** kmn, image_t** img, int threads);
+kmean_t* kmeans_cluster_hist(kmean_t** kmn, image_t** img, int threads);
+kmean_t* kmeans_label_pixels(kmean_t** kmn, image_t** img, int threads);
+double kmeans_update_centroids(kmean_t** kmn,
+                               const uint64_t* group_size,
+                               const uint64_t* rgb_values,
+                               float* drift);
+bool kmeans_converged(kmean_t** kmn,
+                      int iter,
+                      double shift,
+                      uint64_t changed,
+                      uint64_t total);
+void kmeans_report(kmean_t** kmn);
+char* kmeans_cl_source(cl_env_t** env);
+cl_ulong kmeans_cl_time(cl_env_t** env,
+                        cl_xpair_t* xpair,
+                        cl_uint px_per_item_position,
+                        int n,
+                        kmean_cl_launch_t launch);
+kmean_cl_launch_t kmeans_cl_autotune(cl_env_t** env,
+                                     cl_xpair_t* xpair,
+                                     cl_uint px_per_item_position,
+                                     int n);
+bool kmeans_cl_tuning_load(cl_env_t** env,
+                           int k,
+                           kmean_cl_launch_t* assign,
+                           kmean_cl_launch_t* reduce);
+void kmeans_cl_tuning_store(cl_env_t** env,
+                            int k,
+                            const kmean_cl_launch_t* assign,
+                            const kmean_cl_launch_t* reduce);
 kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
                             cl_env_t** env,
                             image_t** img_in,
                             image_t** img_out);
 kmean_t* kmeans_image(kmean_t** kmn, image_t** img_in, image_t** img_out);
+image_t* kmeans_image_alloc(kmean_t** kmn,
+                            image_t** img_in,
+                            image_t** img_out,
+                            bool borrow_labels);
+void kmeans_image_range(kmean_t** kmn,
+                        const uint32_t* _palette,
+                        int begin,
+                        int end,
+                        uint8_t* data);
+void kmeans_image_palette(kmean_t** kmn, image_t** img_out, uint32_t* palette);
+uint32_t* kmeans_palette(kmean_t** kmn);
 kmean_t* kmeans_image_multithr(kmean_t** kmn,
                                image_t** img_in,
                                image_t** img_out,
@@ -42,11 +178,23 @@ kmean_t* kmeans_image_multithr(kmean_t** kmn,
 double kmeans_sample_norm(kmean_sample_t* sample);
 inline double kmeans_sample_euclid2(kmean_sample_t* sample1,
                                     kmean_sample_t* sample2);
+static inline int kmeans_sample_dist2(const kmean_sample_t* sample1,
+                                      const kmean_sample_t* sample2);
+int kmeans_algo_parse(const char* _name);
+const char* kmeans_algo_name(kmean_algo_t algo);
+int kmeans_mode_parse(const char* _name);
+const char* kmeans_mode_name(kmean_mode_t mode);
+int kmeans_out_parse(const char* _name);
+const char* kmeans_out_name(kmean_out_t out);
+int kmeans_out_comp(kmean_out_t out);
+int kmeans_schedule_parse(const char* _name);
+const char* kmeans_schedule_name(omp_sched_t schedule);
 void kmeans_free(kmean_t** kmn);
 
 kmean_t* kmeans_init(kmean_t** kmn, int k, int iter, image_t** img)
 {
     assert(*img != NULL);
+    assert(k > 0 && k <= SIMD_MAX_K);
 
     if (*kmn == NULL)
     {
@@ -55,8 +203,22 @@ kmean_t* kmeans_init(kmean_t** kmn, int k, int iter, image_t** img)
 
     (*kmn)->k = k;
     (*kmn)->iter = iter;
+    (*kmn)->iter_done = 0;
+    (*kmn)->tol = 0.0;
+    (*kmn)->min_changed = 0.0;
+    (*kmn)->algo = KMEANS_ALGO_LLOYD;
+    (*kmn)->mode = KMEANS_MODE_PIXEL;
+    (*kmn)->out = KMEANS_OUT_RGBA;
+    (*kmn)->schedule = omp_sched_static;
+    (*kmn)->chunk = 0;
+    (*kmn)->autotune = false;
+    (*kmn)->hist = NULL;
+    (*kmn)->hist_centroid = NULL;
+    (*kmn)->dist_evals = 0;
+    (*kmn)->dist_total = 0;
     (*kmn)->centroids = (kmean_sample_t*)malloc(k * sizeof(kmean_sample_t));
-    (*kmn)->px_centroid = (int*)malloc((*img)->size_pixels * sizeof(int));
+    (*kmn)->px_centroid = (simd_label_t*)malloc((*img)->size_pixels *
+                                                sizeof(simd_label_t));
 
     printf("initialize kmeans clustering...\n");
     printf("cluster count is %d, iteration count is %d\n",
@@ -66,13 +228,13 @@ kmean_t* kmeans_init(kmean_t** kmn, int k, int iter, image_t** img)
     return (*kmn);
 }
 
-kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img)
+kmean_t* kmeans_seed(kmean_t** kmn, image_t** img)
 {
     assert(*kmn != NULL);
     assert(*img != NULL);
 
-    printf("begin clustering...\n");
-
+    // Seeding is always serial, so that every algorithm and thread count
+    // starts from the same centroids for a given random state.
     for (int k = 0; k < (*kmn)->k; k++)
     {
         kmean_sample_t centroid;
@@ -88,6 +250,35 @@ kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img)
         printf("c%d: %d, %d, %d\n", k, centroid.r, centroid.g, centroid.b);
     }
 
+    return (*kmn);
+}
+
+kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img)
+{
+    assert(*kmn != NULL);
+    assert(*img != NULL);
+
+    if ((*kmn)->mode != KMEANS_MODE_PIXEL)
+    {
+        return kmeans_cluster_hist(kmn, img, 1);
+    }
+    else if ((*kmn)->algo == KMEANS_ALGO_ELKAN)
+    {
+        return kmeans_cluster_elkan(kmn, img, 1);
+    }
+    else if ((*kmn)->algo == KMEANS_ALGO_HAMERLY)
+    {
+        return kmeans_cluster_hamerly(kmn, img, 1);
+    }
+
+    printf("begin clustering with %s kernels...\n",
+           simd_isa_name(simd_kernels.isa));
+
+    kmeans_seed(kmn, img);
+
+    simd_centroids_t* soa = NULL;
+    simd_centroids_init(&soa, (*kmn)->k);
+
     int iter = 0;
     uint64_t* group_size = (uint64_t*)calloc((*kmn)->k, sizeof(uint64_t));
     uint64_t* rgb_values = (uint64_t*)calloc(3 * (*kmn)->k, sizeof(uint64_t));
@@ -95,68 +286,39 @@ kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img)
     {
         printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
 
-        kmean_sample_t sample;
-
-        // Iterate through each pixel in image.
-        double euclid;
-        int group;
-        for (int i = 0; i < (*img)->size_pixels; i++)
-        {
-            sample.r = (int)((*img)->DATA[i * (*img)->comp + 0]);
-            sample.g = (int)((*img)->DATA[i * (*img)->comp + 1]);
-            sample.b = (int)((*img)->DATA[i * (*img)->comp + 2]);
-
-            euclid = DBL_MAX;
-            group = 0;
-            // Iterate through each group of k groups.
-            for (int k = 0; k < (*kmn)->k; k++)
-            {
-                // Find the smallest squared euclid distance to a centroid for
-                // this pixel.
-                double e =
-                    kmeans_sample_euclid2(&((*kmn)->centroids[k]), &sample);
-                if (e < euclid)
-                {
-                    euclid = e;
-                    group = k;
-                }
-            }
-
-            // This pixel now belongs to the group with the nearest centroid.
-            (*kmn)->px_centroid[i] = group;
-        }
-
-        // Calculate the new centroid for each pixel group.
-        memset(group_size, 0, (*kmn)->k * sizeof(int));
-        memset(rgb_values, 0, 3 * (*kmn)->k * sizeof(int));
-        for (int i = 0; i < (*img)->size_pixels; i++)
-        {
-            group_size[(*kmn)->px_centroid[i]]++;
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 0] +=
-                (int)((*img)->DATA[i * (*img)->comp + 0]);
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 1] +=
-                (int)((*img)->DATA[i * (*img)->comp + 1]);
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 2] +=
-                (int)((*img)->DATA[i * (*img)->comp + 2]);
-        }
+        // Find the nearest centroid for each pixel in image, and sum up the
+        // pixels of each group in the same pass.
+        simd_centroids_load(&soa, (const int*)(*kmn)->centroids);
+        memset(group_size, 0, (*kmn)->k * sizeof(uint64_t));
+        memset(rgb_values, 0, 3 * (*kmn)->k * sizeof(uint64_t));
+        uint64_t changed = simd_assign_accumulate(soa,
+                                                  (*img)->DATA,
+                                                  (*img)->comp,
+                                                  0,
+                                                  (*img)->size_pixels,
+                                                  (*kmn)->px_centroid,
+                                                  iter == 1,
+                                                  group_size,
+                                                  rgb_values);
 
         // Average out all the pixel values.
-        for (int k = 0; k < (*kmn)->k; k++)
-        {
-            if (group_size[k] == 0) continue;
-            (*kmn)->centroids[k].r =
-                (int)(rgb_values[k * 3 + 0] / group_size[k]);
-            (*kmn)->centroids[k].g =
-                (int)(rgb_values[k * 3 + 1] / group_size[k]);
-            (*kmn)->centroids[k].b =
-                (int)(rgb_values[k * 3 + 2] / group_size[k]);
-        }
+        double shift =
+            kmeans_update_centroids(kmn, group_size, rgb_values, NULL);
+        if (kmeans_converged(
+                kmn, iter, shift, changed, (*img)->size_pixels))
+            break;
     }
 
+    simd_centroids_free(&soa);
     free(group_size);
     free(rgb_values);
     printf("end clustering...\n");
 
+    (*kmn)->dist_total =
+        (uint64_t)(*img)->size_pixels * (*kmn)->k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = (*kmn)->dist_total;
+    kmeans_report(kmn);
+
     for (int k = 0; k < (*kmn)->k; k++)
     {
         printf("c%d: %d, %d, %d\n",
@@ -169,6 +331,218 @@ kmean_t* kmeans_cluster(kmean_t** kmn, image_t** img)
     return (*kmn);
 }
 
+// Returns the OpenCL source to build, which is the file at the env source path
+// if one is set, and otherwise the sources embedded at build time. Builds
+// without embedded sources read compress.cl from the working directory. The
+// caller frees the returned source.
+char* kmeans_cl_source(cl_env_t** env)
+{
+    assert(*env != NULL);
+
+    char* buf = NULL;
+
+#ifdef KMEANS_EMBED_CL
+    if ((*env)->source_path == NULL)
+    {
+        buf = (char*)malloc(sizeof(COMPRESS_CL));
+        memcpy(buf, COMPRESS_CL, sizeof(COMPRESS_CL));
+
+        printf("using embedded cl source...\n");
+
+        return buf;
+    }
+#endif
+
+    const char* path =
+        (*env)->source_path != NULL ? (*env)->source_path : "compress.cl";
+    file_read(path, &buf);
+
+    printf("read cl source file %s...\n", path);
+
+    return buf;
+}
+
+// Launches the pixel kernel once with the given shape and returns its device
+// time in nanoseconds.
+cl_ulong kmeans_cl_time(cl_env_t** env,
+                        cl_xpair_t* xpair,
+                        cl_uint px_per_item_position,
+                        int n,
+                        kmean_cl_launch_t launch)
+{
+    const size_t items = (n + launch.px_per_item - 1) / launch.px_per_item;
+    const size_t global_size = cl_global_size(items, launch.local_size);
+
+    // Set directly rather than through cl_add_kernel_arg_prim, since it only
+    // changes an argument of an already set up kernel.
+    CL_RET = clSetKernelArg(
+        xpair->kernel, px_per_item_position, sizeof(int), &launch.px_per_item);
+    CL_CHECK_ERR(CL_RET);
+
+    cl_event event;
+    cl_enqueue_kernel(env, xpair, 1, &global_size, &launch.local_size, &event);
+
+    return cl_event_elapsed(&event);
+}
+
+// Times the pixel kernel over work-group sizes from the preferred multiple up
+// to the kernel limit, and pixels per work-item up to
+// KMEANS_TUNE_MAX_PX_PER_ITEM, both in powers of two. Each candidate is timed
+// KMEANS_TUNE_RUNS times and the fastest run counts, so the kernel has to
+// give the same result when it is run repeatedly.
+kmean_cl_launch_t kmeans_cl_autotune(cl_env_t** env,
+                                     cl_xpair_t* xpair,
+                                     cl_uint px_per_item_position,
+                                     int n)
+{
+    const size_t max_size = cl_kernel_local_size(env, xpair);
+    const size_t multiple = cl_kernel_size_multiple(env, xpair);
+
+    kmean_cl_launch_t best = {max_size, 1};
+    cl_ulong best_time = ULLONG_MAX;
+
+    for (size_t local_size = multiple <= max_size ? multiple : max_size;
+         local_size <= max_size;
+         local_size *= 2)
+    {
+        for (int px_per_item = 1; px_per_item <= KMEANS_TUNE_MAX_PX_PER_ITEM;
+             px_per_item *= 2)
+        {
+            kmean_cl_launch_t launch = {local_size, px_per_item};
+            cl_ulong time = ULLONG_MAX;
+            for (int run = 0; run < KMEANS_TUNE_RUNS; run++)
+            {
+                cl_ulong t =
+                    kmeans_cl_time(env, xpair, px_per_item_position, n, launch);
+                if (t < time) time = t;
+            }
+
+            printf("tuning: local_size=%zu px_per_item=%d time=%.3fms\n",
+                   local_size,
+                   px_per_item,
+                   time / 1e6);
+
+            if (time < best_time)
+            {
+                best_time = time;
+                best = launch;
+            }
+        }
+    }
+
+    return best;
+}
+
+// Reads the tuned launch shapes for this device and k, saved by an earlier
+// --autotune run. Returns false when there are none, or they no longer fit
+// the kernel limits.
+bool kmeans_cl_tuning_load(cl_env_t** env,
+                           int k,
+                           kmean_cl_launch_t* assign,
+                           kmean_cl_launch_t* reduce)
+{
+    char* path = cl_cache_file("autotune");
+    if (path == NULL) return false;
+
+    FILE* fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL) return false;
+
+    const unsigned long long device_key = cl_device_key(env);
+    bool found = false;
+    char line[256];
+
+    while (!found && fgets(line, sizeof(line), fp) != NULL)
+    {
+        unsigned long long key;
+        int line_k;
+        kmean_cl_launch_t a, r;
+        if (sscanf(line,
+                   "%llx %d %zu %d %zu %d",
+                   &key,
+                   &line_k,
+                   &a.local_size,
+                   &a.px_per_item,
+                   &r.local_size,
+                   &r.px_per_item) == 6 &&
+            key == device_key && line_k == k)
+        {
+            *assign = a;
+            *reduce = r;
+            found = true;
+        }
+    }
+
+    fclose(fp);
+
+    return found;
+}
+
+// Saves the launch shapes for this device and k, replacing earlier ones. Each
+// line of the file holds the device key, k, and the work-group size and
+// pixels per work-item of the assign and reduce kernels.
+void kmeans_cl_tuning_store(cl_env_t** env,
+                            int k,
+                            const kmean_cl_launch_t* assign,
+                            const kmean_cl_launch_t* reduce)
+{
+    char* path = cl_cache_file("autotune");
+    if (path == NULL) return;
+
+    size_t tmp_size = strlen(path) + 32;
+    char* tmp_path = (char*)malloc(tmp_size);
+    snprintf(tmp_path, tmp_size, "%s.%ld.tmp", path, (long)getpid());
+
+    const unsigned long long device_key = cl_device_key(env);
+    FILE* out = fopen(tmp_path, "w");
+    if (out == NULL)
+    {
+        perror("error writing tuning file");
+        free(tmp_path);
+        free(path);
+        return;
+    }
+
+    // Keep the entries of other devices and k.
+    FILE* in = fopen(path, "r");
+    if (in != NULL)
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), in) != NULL)
+        {
+            unsigned long long key;
+            int line_k;
+            if (sscanf(line, "%llx %d", &key, &line_k) == 2 &&
+                key == device_key && line_k == k)
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(out,
+            "%016llx %d %zu %d %zu %d\n",
+            device_key,
+            k,
+            assign->local_size,
+            assign->px_per_item,
+            reduce->local_size,
+            reduce->px_per_item);
+
+    if (fclose(out) == 0 && rename(tmp_path, path) == 0)
+    {
+        printf("stored tuning in %s\n", path);
+    }
+    else
+    {
+        perror("error writing tuning file");
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+}
+
 kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
                             cl_env_t** env,
                             image_t** img_in,
@@ -178,10 +552,20 @@ kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
     assert(*env != NULL);
     assert(*img_in != NULL);
 
-    char* buf = NULL;
-    file_read("compress.cl", &buf, BUFSIZ);
+    // The cluster sums are 64-bit, and take 64-bit atomics when the device
+    // has them.
+    const bool int64_atomics =
+        cl_device_extension(env, "cl_khr_int64_base_atomics");
+    const int partials = int64_atomics ? 1 : KMEANS_CL_PARTIALS;
+    const size_t max_group_px =
+        int64_atomics ? KMEANS_CL_MAX_GROUP_PX : KMEANS_CL_MAX_GROUP_PX / 2;
+    if (!int64_atomics)
+    {
+        printf("no 64-bit atomics, reducing through %d partial sums...\n",
+               partials);
+    }
 
-    printf("read cl source file...\n");
+    char* buf = kmeans_cl_source(env);
 
     int* rand_vector = (int*)malloc((*kmn)->k * sizeof(int));
     for (int k = 0; k < (*kmn)->k; k++)
@@ -190,15 +574,60 @@ kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
     }
     printf("initialized random vector...\n");
 
-    cl_program* program = cl_create_program(env, buf);
-    cl_xpair_t* xpair = cl_create_kernel(env, program, "compress");
+    // Variants are specialized for k and the channel count, so the device
+    // compiler sees constant loop bounds and pixel strides. Labels use the
+    // host label type on the device too.
+    char options[96];
+    snprintf(options,
+             sizeof(options),
+             "-DK=%d -DCOMP=%d -DLABEL_T=%s -DPARTIALS=%d%s",
+             (*kmn)->k,
+             (*img_in)->comp,
+             SIMD_LABEL_CL_TYPE,
+             partials,
+             int64_atomics ? " -DINT64_ATOMICS" : "");
+
+    cl_program* program = cl_create_program(env, buf, options);
+    cl_xpair_t* init = cl_create_kernel(env, program, "kmeans_init");
+    cl_xpair_t* assign = cl_create_kernel(env, program, "kmeans_assign");
+    cl_xpair_t* reduce = cl_create_kernel(env, program, "kmeans_reduce");
+    cl_xpair_t* update = cl_create_kernel(env, program, "kmeans_update");
+    cl_xpair_t* map = cl_create_kernel(env, program, "kmeans_map");
+    free(buf);
+
+    // When the device shares memory with the host, it works on the image and
+    // the labels in place. Both move to page aligned memory first if needed,
+    // the labels are only written by the device so they need no copy.
+    const bool zero_copy = (*env)->zero_copy;
+    if (zero_copy)
+    {
+        printf("using zero-copy host buffers...\n");
 
-    cl_mem img_in_mem_obj =
-        clCreateBuffer((*env)->context,
-                       CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
-                       (*img_in)->size_bytes,
-                       (void*)((*img_in)->DATA),
-                       &CL_RET);
+        if (!cl_host_aligned((*img_in)->DATA))
+        {
+            uint8_t* data = (uint8_t*)cl_host_alloc((*img_in)->size_bytes);
+            memcpy(data, (*img_in)->DATA, (*img_in)->size_bytes);
+            image_free_data(img_in);
+            (*img_in)->DATA = data;
+            (*img_in)->owner = IMAGE_OWNER_MALLOC;
+        }
+
+        if (!cl_host_aligned((*kmn)->px_centroid))
+        {
+            free((*kmn)->px_centroid);
+            (*kmn)->px_centroid = (simd_label_t*)cl_host_alloc(
+                (*img_in)->size_pixels * sizeof(simd_label_t));
+        }
+    }
+
+    // Without zero-copy the image is written after the buffers are labeled,
+    // so the upload shows up in the profile.
+    cl_mem img_in_mem_obj = clCreateBuffer(
+        (*env)->context,
+        (zero_copy ? CL_MEM_USE_HOST_PTR : 0) | CL_MEM_READ_ONLY,
+        (*img_in)->size_bytes,
+        zero_copy ? (void*)((*img_in)->DATA) : NULL,
+        &CL_RET);
     CL_CHECK_ERR(CL_RET);
 
     cl_mem kmeans_rand_vector_mem_obj =
@@ -217,59 +646,288 @@ kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
                        &CL_RET);
     CL_CHECK_ERR(CL_RET);
 
-    cl_mem kmeans_px_centroids_mem_obj =
+    cl_mem kmeans_px_centroids_mem_obj = clCreateBuffer(
+        (*env)->context,
+        (zero_copy ? CL_MEM_USE_HOST_PTR : CL_MEM_ALLOC_HOST_PTR) |
+            CL_MEM_READ_WRITE,
+        (*img_in)->size_pixels * sizeof(simd_label_t),
+        zero_copy ? (void*)(*kmn)->px_centroid : NULL,
+        &CL_RET);
+    CL_CHECK_ERR(CL_RET);
+
+    cl_mem kmeans_group_size_mem_obj =
         clCreateBuffer((*env)->context,
                        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
-                       (*img_in)->size_pixels * sizeof(int),
+                       (*kmn)->k * sizeof(uint64_t),
                        NULL,
                        &CL_RET);
     CL_CHECK_ERR(CL_RET);
 
-    cl_mem kmeans_group_size_mem_obj =
+    cl_mem kmeans_rgb_values_mem_obj =
         clCreateBuffer((*env)->context,
                        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
-                       (*kmn)->k * sizeof(uint32_t),
+                       3 * (*kmn)->k * sizeof(uint64_t),
                        NULL,
                        &CL_RET);
     CL_CHECK_ERR(CL_RET);
 
-    cl_mem kmeans_rgb_values_mem_obj =
+    // Only read by the kernels without 64-bit atomics, a single slot is
+    // enough otherwise.
+    cl_mem kmeans_partials_mem_obj =
+        clCreateBuffer((*env)->context,
+                       CL_MEM_READ_WRITE,
+                       partials * 4 * (*kmn)->k * sizeof(uint32_t),
+                       NULL,
+                       &CL_RET);
+    CL_CHECK_ERR(CL_RET);
+
+    // The changed pixel count and the largest squared centroid shift of the
+    // current iteration.
+    cl_mem kmeans_state_mem_obj =
         clCreateBuffer((*env)->context,
                        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
-                       3 * (*kmn)->k * sizeof(uint32_t),
+                       2 * sizeof(int),
                        NULL,
                        &CL_RET);
     CL_CHECK_ERR(CL_RET);
 
-    cl_add_kernel_arg_mem_obj(env, xpair, 0, sizeof(cl_mem), img_in_mem_obj);
+    cl_label_mem_obj(env, img_in_mem_obj, "image");
+    cl_label_mem_obj(env, kmeans_rand_vector_mem_obj, "rand_vector");
+    cl_label_mem_obj(env, kmeans_centroids_mem_obj, "centroids");
+    cl_label_mem_obj(env, kmeans_px_centroids_mem_obj, "px_centroids");
+    cl_label_mem_obj(env, kmeans_group_size_mem_obj, "group_size");
+    cl_label_mem_obj(env, kmeans_rgb_values_mem_obj, "rgb_values");
+    cl_label_mem_obj(env, kmeans_partials_mem_obj, "partials");
+    cl_label_mem_obj(env, kmeans_state_mem_obj, "state");
+
+    if (!zero_copy)
+    {
+        cl_write_buffer(env,
+                        &img_in_mem_obj,
+                        CL_FALSE,
+                        (*img_in)->size_bytes,
+                        (*img_in)->DATA);
+    }
+
+    const int n = (*img_in)->size_pixels;
+
+    cl_add_kernel_arg_mem_obj(env, init, 0, sizeof(cl_mem), img_in_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, init, 1, sizeof(cl_mem), kmeans_rand_vector_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, init, 2, sizeof(cl_mem), kmeans_centroids_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, init, 3, sizeof(cl_mem), kmeans_group_size_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, init, 4, sizeof(cl_mem), kmeans_rgb_values_mem_obj);
+    cl_add_kernel_arg_prim(env, init, 5, sizeof(int), (void*)&((*kmn)->k));
+    cl_add_kernel_arg_prim(
+        env, init, 6, sizeof(int), (void*)&((*img_in)->comp));
+
+    cl_add_kernel_arg_mem_obj(env, assign, 0, sizeof(cl_mem), img_in_mem_obj);
     cl_add_kernel_arg_mem_obj(
-        env, xpair, 1, sizeof(cl_mem), kmeans_rand_vector_mem_obj);
+        env, assign, 1, sizeof(cl_mem), kmeans_centroids_mem_obj);
     cl_add_kernel_arg_mem_obj(
-        env, xpair, 2, sizeof(cl_mem), kmeans_centroids_mem_obj);
+        env, assign, 2, sizeof(cl_mem), kmeans_px_centroids_mem_obj);
     cl_add_kernel_arg_mem_obj(
-        env, xpair, 3, sizeof(cl_mem), kmeans_px_centroids_mem_obj);
+        env, assign, 3, sizeof(cl_mem), kmeans_state_mem_obj);
+    cl_add_kernel_arg_prim(env, assign, 4, sizeof(int), (void*)&((*kmn)->k));
+    cl_add_kernel_arg_prim(env, assign, 5, sizeof(int), (void*)&n);
+    cl_add_kernel_arg_prim(
+        env, assign, 6, sizeof(int), (void*)&((*img_in)->comp));
+
+    cl_add_kernel_arg_mem_obj(env, reduce, 0, sizeof(cl_mem), img_in_mem_obj);
     cl_add_kernel_arg_mem_obj(
-        env, xpair, 4, sizeof(cl_mem), kmeans_group_size_mem_obj);
+        env, reduce, 1, sizeof(cl_mem), kmeans_px_centroids_mem_obj);
     cl_add_kernel_arg_mem_obj(
-        env, xpair, 5, sizeof(cl_mem), kmeans_rgb_values_mem_obj);
-    cl_add_kernel_arg_prim(env, xpair, 6, sizeof(int), (void*)&((*kmn)->k));
-    cl_add_kernel_arg_prim(env, xpair, 7, sizeof(int), (void*)&((*kmn)->iter));
+        env, reduce, 2, sizeof(cl_mem), kmeans_group_size_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, reduce, 3, sizeof(cl_mem), kmeans_rgb_values_mem_obj);
+    cl_add_kernel_arg_local(env, reduce, 4, 4 * (*kmn)->k * sizeof(uint32_t));
+    cl_add_kernel_arg_prim(env, reduce, 5, sizeof(int), (void*)&((*kmn)->k));
+    cl_add_kernel_arg_prim(env, reduce, 6, sizeof(int), (void*)&n);
     cl_add_kernel_arg_prim(
-        env, xpair, 8, sizeof(int), (void*)&((*img_in)->width));
+        env, reduce, 7, sizeof(int), (void*)&((*img_in)->comp));
+    cl_add_kernel_arg_mem_obj(
+        env, reduce, 9, sizeof(cl_mem), kmeans_partials_mem_obj);
+
+    cl_add_kernel_arg_mem_obj(
+        env, update, 0, sizeof(cl_mem), kmeans_centroids_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, update, 1, sizeof(cl_mem), kmeans_group_size_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, update, 2, sizeof(cl_mem), kmeans_rgb_values_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, update, 3, sizeof(cl_mem), kmeans_state_mem_obj);
+    cl_add_kernel_arg_prim(env, update, 4, sizeof(int), (void*)&((*kmn)->k));
+    cl_add_kernel_arg_mem_obj(
+        env, update, 5, sizeof(cl_mem), kmeans_partials_mem_obj);
+
+    // Centroid kernels run one work-item per centroid. Pixel kernels default
+    // to one work-item per pixel in the largest work-groups they can run
+    // with, unless tuned otherwise.
+    const size_t _centroid_work_size = (*kmn)->k;
+    kmean_cl_launch_t assign_launch = {cl_kernel_local_size(env, assign), 1};
+    kmean_cl_launch_t reduce_launch = {cl_kernel_local_size(env, reduce), 1};
+
+    // Assign compares every label with the new one before writing it, so the
+    // labels start out zeroed. The host ignores the first change count.
+    const int zero = 0;
+    const simd_label_t zero_label = 0;
+    cl_enqueue_kernel(env, init, 1, &_centroid_work_size, NULL, NULL);
+    cl_fill_buffer(env,
+                   &kmeans_px_centroids_mem_obj,
+                   &zero_label,
+                   sizeof(simd_label_t),
+                   n * sizeof(simd_label_t));
+    cl_fill_buffer(env,
+                   &kmeans_partials_mem_obj,
+                   &zero,
+                   sizeof(int),
+                   partials * 4 * (*kmn)->k * sizeof(uint32_t));
+
+    if ((*kmn)->autotune)
+    {
+        // Reduce needs the labels assign leaves behind. Both only get
+        // timed, so the sums are reset afterwards.
+        assign_launch = kmeans_cl_autotune(env, assign, 7, n);
+        reduce_launch = kmeans_cl_autotune(env, reduce, 8, n);
+        kmeans_cl_tuning_store(env, (*kmn)->k, &assign_launch, &reduce_launch);
+
+        cl_fill_buffer(env,
+                       &kmeans_group_size_mem_obj,
+                       &zero,
+                       sizeof(int),
+                       (*kmn)->k * sizeof(uint64_t));
+        cl_fill_buffer(env,
+                       &kmeans_rgb_values_mem_obj,
+                       &zero,
+                       sizeof(int),
+                       3 * (*kmn)->k * sizeof(uint64_t));
+        cl_fill_buffer(env,
+                       &kmeans_partials_mem_obj,
+                       &zero,
+                       sizeof(int),
+                       partials * 4 * (*kmn)->k * sizeof(uint32_t));
+    }
+    else
+    {
+        kmean_cl_launch_t a, r;
+        if (kmeans_cl_tuning_load(env, (*kmn)->k, &a, &r) &&
+            a.local_size <= assign_launch.local_size &&
+            r.local_size <= reduce_launch.local_size && a.local_size > 0 &&
+            r.local_size > 0 && a.px_per_item > 0 && r.px_per_item > 0 &&
+            r.local_size * r.px_per_item <= max_group_px)
+        {
+            printf("using tuned launch shapes...\n");
+            assign_launch = a;
+            reduce_launch = r;
+        }
+    }
+    assert(reduce_launch.local_size * reduce_launch.px_per_item <=
+           max_group_px);
+
     cl_add_kernel_arg_prim(
-        env, xpair, 9, sizeof(int), (void*)&((*img_in)->height));
+        env, assign, 7, sizeof(int), (void*)&assign_launch.px_per_item);
     cl_add_kernel_arg_prim(
-        env, xpair, 10, sizeof(int), (void*)&((*img_in)->comp));
+        env, reduce, 8, sizeof(int), (void*)&reduce_launch.px_per_item);
+
+    const size_t _assign_local_size = assign_launch.local_size;
+    const size_t _assign_global_size = cl_global_size(
+        (n + assign_launch.px_per_item - 1) / assign_launch.px_per_item,
+        _assign_local_size);
+    const size_t _reduce_local_size = reduce_launch.local_size;
+    const size_t _reduce_global_size = cl_global_size(
+        (n + reduce_launch.px_per_item - 1) / reduce_launch.px_per_item,
+        _reduce_local_size);
+
+    printf("assign work-group size %zu with %d px per work-item, reduce "
+           "work-group size %zu with %d px per work-item\n",
+           _assign_local_size,
+           assign_launch.px_per_item,
+           _reduce_local_size,
+           reduce_launch.px_per_item);
+
+    // The queue is in order, so every kernel sees the results of the ones
+    // before it. Only the small state buffer is read back per iteration.
+    int iter = 0;
+    while (iter++ < (*kmn)->iter)
+    {
+        printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
 
-    const size_t _local_work_size = 512;
-    const size_t _workgroup_count = (*img_in)->size_pixels / _local_work_size;
-    const size_t _global_work_size = _local_work_size * _workgroup_count;
+        cl_fill_buffer(
+            env, &kmeans_state_mem_obj, &zero, sizeof(int), 2 * sizeof(int));
+        cl_enqueue_kernel(
+            env, assign, 1, &_assign_global_size, &_assign_local_size, NULL);
+        cl_enqueue_kernel(
+            env, reduce, 1, &_reduce_global_size, &_reduce_local_size, NULL);
+        cl_enqueue_kernel(env, update, 1, &_centroid_work_size, NULL, NULL);
+
+        int state[2];
+        cl_read_buffer(env,
+                       &kmeans_state_mem_obj,
+                       CL_TRUE,
+                       2 * sizeof(int),
+                       (void*)state);
+        // Every pixel counts as changed in the first iteration, whatever
+        // the labels held before.
+        uint64_t changed = iter == 1 ? (uint64_t)n : (uint64_t)state[0];
+        if (kmeans_converged(kmn, iter, sqrt((double)state[1]), changed, n))
+            break;
+    }
 
-    cl_enqueue_kernel(
-        env, xpair, 1, &_global_work_size, &_local_work_size, NULL);
+    // The output image is written on the device, so it is the only pixel
+    // buffer that comes back. The labels stay on the device, and px_centroid
+    // is left as is.
+    printf("writing image data on the device...\n");
+    kmeans_image_alloc(kmn, img_in, img_out, false);
+    if (zero_copy && !cl_host_aligned((*img_out)->DATA))
+    {
+        free((*img_out)->DATA);
+        (*img_out)->DATA = (uint8_t*)cl_host_alloc((*img_out)->size_bytes);
+    }
 
-    CL_RET = clFinish((*env)->command_queue);
+    cl_mem img_out_mem_obj = clCreateBuffer(
+        (*env)->context,
+        zero_copy ? CL_MEM_USE_HOST_PTR | CL_MEM_WRITE_ONLY
+                  : CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY,
+        (*img_out)->size_bytes,
+        zero_copy ? (void*)(*img_out)->DATA : NULL,
+        &CL_RET);
     CL_CHECK_ERR(CL_RET);
+    cl_label_mem_obj(env, img_out_mem_obj, "image_out");
+
+    const size_t _map_local_size = cl_kernel_local_size(env, map);
+    const size_t _map_global_size = cl_global_size(n, _map_local_size);
+
+    cl_add_kernel_arg_mem_obj(
+        env, map, 0, sizeof(cl_mem), kmeans_px_centroids_mem_obj);
+    cl_add_kernel_arg_mem_obj(
+        env, map, 1, sizeof(cl_mem), kmeans_centroids_mem_obj);
+    cl_add_kernel_arg_mem_obj(env, map, 2, sizeof(cl_mem), img_out_mem_obj);
+    cl_add_kernel_arg_prim(env, map, 3, sizeof(int), (void*)&n);
+    cl_add_kernel_arg_prim(
+        env, map, 4, sizeof(int), (void*)&((*img_out)->comp));
+    cl_enqueue_kernel(
+        env, map, 1, &_map_global_size, &_map_local_size, NULL);
+
+    // Mapping a buffer over host memory hands back that memory itself, it
+    // only makes the device writes visible to the host.
+    if (zero_copy)
+    {
+        void* data = cl_map_buffer(
+            env, &img_out_mem_obj, CL_MAP_READ, (*img_out)->size_bytes);
+        assert(data == (void*)(*img_out)->DATA);
+        cl_unmap_buffer(env, &img_out_mem_obj, data);
+    }
+    else
+    {
+        cl_read_buffer(env,
+                       &img_out_mem_obj,
+                       CL_TRUE,
+                       (*img_out)->size_bytes,
+                       (void*)(*img_out)->DATA);
+    }
 
     int* centroids = (int*)malloc(3 * (*kmn)->k * sizeof(int));
 
@@ -279,11 +937,9 @@ kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
                    3 * (*kmn)->k * sizeof(int),
                    (void*)centroids);
 
-    cl_read_buffer(env,
-                   &kmeans_px_centroids_mem_obj,
-                   CL_TRUE,
-                   (*img_in)->size_pixels * sizeof(int),
-                   (void*)(*kmn)->px_centroid);
+    (*kmn)->dist_total = (uint64_t)n * (*kmn)->k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = (*kmn)->dist_total;
+    kmeans_report(kmn);
 
     for (int i = 0; i < (*kmn)->k; i++)
     {
@@ -298,8 +954,21 @@ kmean_t* kmeans_cluster_gpu(kmean_t** kmn,
         (*kmn)->centroids[i].b = centroids[i * 3 + 2];
     }
 
+    kmeans_image_palette(kmn, img_out, kmeans_palette(kmn));
+
+    // The kernels hold their own references to the buffers.
+    clReleaseMemObject(img_in_mem_obj);
+    clReleaseMemObject(kmeans_rand_vector_mem_obj);
+    clReleaseMemObject(kmeans_centroids_mem_obj);
+    clReleaseMemObject(kmeans_px_centroids_mem_obj);
+    clReleaseMemObject(kmeans_group_size_mem_obj);
+    clReleaseMemObject(kmeans_rgb_values_mem_obj);
+    clReleaseMemObject(kmeans_partials_mem_obj);
+    clReleaseMemObject(kmeans_state_mem_obj);
+    clReleaseMemObject(img_out_mem_obj);
+
+    free(rand_vector);
     free(centroids);
-    kmeans_image(kmn, img_in, img_out);
 
     return (*kmn);
 }
@@ -309,111 +978,141 @@ kmean_t* kmeans_cluster_multithr(kmean_t** kmn, image_t** img, int threads)
     assert(*kmn != NULL);
     assert(*img != NULL);
 
+    if ((*kmn)->mode != KMEANS_MODE_PIXEL)
+    {
+        return kmeans_cluster_hist(kmn, img, threads);
+    }
+    else if ((*kmn)->algo == KMEANS_ALGO_ELKAN)
+    {
+        return kmeans_cluster_elkan(kmn, img, threads);
+    }
+    else if ((*kmn)->algo == KMEANS_ALGO_HAMERLY)
+    {
+        return kmeans_cluster_hamerly(kmn, img, threads);
+    }
+
     omp_set_num_threads(threads);
 
     uint64_t* group_size = (uint64_t*)calloc((*kmn)->k, sizeof(uint64_t));
     uint64_t* rgb_values = (uint64_t*)calloc(3 * (*kmn)->k, sizeof(uint64_t));
 
-    printf("begin clustering with %d threads...\n", threads);
-
-#pragma omp parallel for schedule(dynamic) shared(kmn, img) default(none)
-    for (int k = 0; k < (*kmn)->k; k++)
+    // Each thread sums its pixels into its own group sizes and channel sums,
+    // kept in one block per thread that starts on a cache line and is padded
+    // to whole lines, so threads never write to a shared line.
+    const int line = KMEANS_CACHE_LINE / sizeof(uint64_t);
+    const int stride = (4 * (*kmn)->k + line - 1) / line * line;
+    uint64_t* partials = (uint64_t*)aligned_alloc(
+        KMEANS_CACHE_LINE, (size_t)threads * stride * sizeof(uint64_t));
+
+    printf("begin clustering with %d threads and %s kernels...\n",
+           threads,
+           simd_isa_name(simd_kernels.isa));
+
+    kmeans_seed(kmn, img);
+
+    simd_centroids_t* soa = NULL;
+    simd_centroids_init(&soa, (*kmn)->k);
+
+    // The whole clustering loop runs in one parallel region. The master
+    // thread does the per-iteration bookkeeping between barriers, and pixel
+    // blocks are shared out with the runtime schedule, which defaults to
+    // static contiguous ranges.
+    omp_set_schedule((*kmn)->schedule, (*kmn)->chunk);
+    memset(partials, 0, (size_t)threads * stride * sizeof(uint64_t));
+    uint64_t changed = 0;
+    bool done = false;
+#pragma omp parallel num_threads(threads) default(none) \
+    shared(img, kmn, soa, threads, stride, partials, group_size, rgb_values, \
+               changed, done)
     {
-        kmean_sample_t centroid;
+        uint64_t* own = partials + omp_get_thread_num() * stride;
 
-        int i = (int)(random() % ((*img)->size_pixels));
-
-        centroid.r = (int)((*img)->DATA[i * (*img)->comp + 0]);
-        centroid.g = (int)((*img)->DATA[i * (*img)->comp + 1]);
-        centroid.b = (int)((*img)->DATA[i * (*img)->comp + 2]);
+        for (int iter = 1; iter <= (*kmn)->iter; iter++)
+        {
+#pragma omp master
+            {
+                printf(
+                    "processing iteration %d/%d...\n", iter, (*kmn)->iter);
+                simd_centroids_load(&soa, (const int*)(*kmn)->centroids);
+                changed = 0;
+            }
 
-#pragma omp critical
-        (*kmn)->centroids[k] = centroid;
+            memset(own, 0, stride * sizeof(uint64_t));
 
-        printf("c%d: %d, %d, %d\n", k, centroid.r, centroid.g, centroid.b);
-    }
+#pragma omp barrier
 
-    int iter = 0;
-    while (iter++ < (*kmn)->iter)
-    {
-        printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
+            // Find the nearest centroid for each pixel in image, a block of
+            // pixels at a time, and sum up the pixels of each group in the
+            // same pass. Pixels are summed into per-thread partials, which
+            // are then merged column-wise in thread order, so the sums never
+            // depend on scheduling.
+#pragma omp for schedule(runtime) reduction(+ : changed) nowait
+            for (int i = 0; i < (*img)->size_pixels; i += KMEANS_SIMD_BLOCK)
+            {
+                int end = i + KMEANS_SIMD_BLOCK < (*img)->size_pixels
+                              ? i + KMEANS_SIMD_BLOCK
+                              : (*img)->size_pixels;
+                changed += simd_assign_accumulate(soa,
+                                                  (*img)->DATA,
+                                                  (*img)->comp,
+                                                  i,
+                                                  end,
+                                                  (*kmn)->px_centroid,
+                                                  iter == 1,
+                                                  own,
+                                                  own + (*kmn)->k);
+            }
 
-        kmean_sample_t sample;
+#pragma omp barrier
 
-        // Iterate through each pixel in image.
-        double euclid;
-        int group;
-#pragma omp parallel for schedule(dynamic) private(euclid, group, sample) \
-    shared(img, kmn) default(none)
-        for (int i = 0; i < (*img)->size_pixels; i++)
-        {
-            sample.r = (int)((*img)->DATA[i * (*img)->comp + 0]);
-            sample.g = (int)((*img)->DATA[i * (*img)->comp + 1]);
-            sample.b = (int)((*img)->DATA[i * (*img)->comp + 2]);
-
-            euclid = DBL_MAX;
-            group = 0;
-            // Iterate through each group of k groups.
-            for (int k = 0; k < (*kmn)->k; k++)
+#pragma omp for schedule(static) nowait
+            for (int c = 0; c < 4 * (*kmn)->k; c++)
             {
-                // Find the smallest squared euclid distance to a centroid
-                // for this pixel.
-                double e =
-                    kmeans_sample_euclid2(&((*kmn)->centroids[k]), &sample);
-                if (e < euclid)
+                uint64_t sum = 0;
+                for (int t = 0; t < threads; t++)
                 {
-                    euclid = e;
-                    group = k;
+                    sum += partials[t * stride + c];
                 }
-            }
 
-            // This pixel now belongs to the group with the nearest
-            // centroid.
-            (*kmn)->px_centroid[i] = group;
-        }
+                if (c < (*kmn)->k)
+                {
+                    group_size[c] = sum;
+                }
+                else
+                {
+                    rgb_values[c - (*kmn)->k] = sum;
+                }
+            }
 
 #pragma omp barrier
 
-        // Calculate the new centroid for each pixel group
-#pragma omp parallel for schedule(dynamic) \
-    shared(group_size, rgb_values, img, kmn) default(none)
-        for (int i = 0; i < (*img)->size_pixels; i++)
-        {
-#pragma omp atomic
-            group_size[(*kmn)->px_centroid[i]]++;
-#pragma omp atomic
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 0] +=
-                (int)((*img)->DATA[i * (*img)->comp + 0]);
-#pragma omp atomic
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 1] +=
-                (int)((*img)->DATA[i * (*img)->comp + 1]);
-#pragma omp atomic
-            rgb_values[(*kmn)->px_centroid[i] * 3 + 2] +=
-                (int)((*img)->DATA[i * (*img)->comp + 2]);
-        }
+            // Average out all the pixel values.
+#pragma omp master
+            {
+                double shift =
+                    kmeans_update_centroids(kmn, group_size, rgb_values, NULL);
+                done = kmeans_converged(
+                    kmn, iter, shift, changed, (*img)->size_pixels);
+            }
 
 #pragma omp barrier
 
-// Average out all the pixel values.
-#pragma omp parallel for schedule(dynamic) \
-    shared(kmn, group_size, rgb_values) default(none)
-        for (int k = 0; k < (*kmn)->k; k++)
-        {
-            if (group_size[k] == 0) continue;
-            (*kmn)->centroids[k].r =
-                (int)(rgb_values[k * 3 + 0] / group_size[k]);
-            (*kmn)->centroids[k].g =
-                (int)(rgb_values[k * 3 + 1] / group_size[k]);
-            (*kmn)->centroids[k].b =
-                (int)(rgb_values[k * 3 + 2] / group_size[k]);
+            if (done) break;
         }
     }
 
+    simd_centroids_free(&soa);
+    free(partials);
     free(group_size);
     free(rgb_values);
 
     printf("end clustering...\n");
 
+    (*kmn)->dist_total =
+        (uint64_t)(*img)->size_pixels * (*kmn)->k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = (*kmn)->dist_total;
+    kmeans_report(kmn);
+
     for (int k = 0; k < (*kmn)->k; k++)
     {
         printf("c%d: %d, %d, %d\n",
@@ -426,45 +1125,652 @@ kmean_t* kmeans_cluster_multithr(kmean_t** kmn, image_t** img, int threads)
     return (*kmn);
 }
 
-kmean_t* kmeans_image_multithr(kmean_t** kmn,
-                               image_t** img_in,
-                               image_t** img_out,
-                               int threads)
+kmean_t* kmeans_cluster_elkan(kmean_t** kmn, image_t** img, int threads)
 {
     assert(*kmn != NULL);
-    assert(*img_in != NULL);
-
-    printf("writing image data with %d threads...\n", threads);
+    assert(*img != NULL);
 
-    omp_set_num_threads(threads);
+    const int k = (*kmn)->k;
+    const int n = (*img)->size_pixels;
+    const int comp = (*img)->comp;
+    const uint8_t* data = (*img)->DATA;
+    kmean_sample_t* centroids = (*kmn)->centroids;
+    simd_label_t* px_centroid = (*kmn)->px_centroid;
+
+    printf("begin elkan clustering with %d threads...\n", threads);
+    printf("elkan bounds use %f MB\n",
+           (double)n * (k + 2) * sizeof(float) / 1e6);
+
+    kmeans_seed(kmn, img);
+
+    // Per pixel: an upper bound on the distance to the assigned centroid and a
+    // lower bound on the distance to every centroid. Bounds are moved lazily,
+    // stamp holds the centroid update they were last moved to.
+    float* upper = (float*)malloc(n * sizeof(float));
+    float* lower = (float*)malloc((size_t)n * k * sizeof(float));
+    int* stamp = (int*)malloc(n * sizeof(int));
+    // Half of the centroid-to-centroid distances, and for each centroid half
+    // the distance to its nearest other centroid.
+    double* half_dist = (double*)malloc(k * k * sizeof(double));
+    double* half_near = (double*)malloc(k * sizeof(double));
+    // Total distance each centroid moved, after each update step.
+    float* drift = (float*)calloc(((*kmn)->iter + 1) * k, sizeof(float));
+
+    uint64_t* group_size = (uint64_t*)calloc(k, sizeof(uint64_t));
+    uint64_t* rgb_values = (uint64_t*)calloc(3 * k, sizeof(uint64_t));
+    uint64_t evals = 0;
 
-    if (*img_out == NULL)
+    int iter = 0;
+    while (iter++ < (*kmn)->iter)
     {
-        *img_out = (image_t*)realloc(*img_out, sizeof(image_t));
+        printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
+
+        for (int a = 0; a < k; a++)
+        {
+            half_near[a] = DBL_MAX;
+            for (int c = 0; c < k; c++)
+            {
+                double d = 0.5 * sqrt((double)kmeans_sample_dist2(
+                                     &centroids[a], &centroids[c]));
+                half_dist[a * k + c] = d;
+                if (c != a && d < half_near[a]) half_near[a] = d;
+            }
+        }
+
+        const int version = iter - 1;
+        uint64_t changed = 0;
+
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, k, comp, data, centroids, px_centroid, upper, lower, stamp,      \
+               half_dist, half_near, drift, version)                          \
+    reduction(+ : evals, changed)
+        for (int i = 0; i < n; i++)
+        {
+            kmean_sample_t sample;
+            sample.r = (int)data[i * comp + 0];
+            sample.g = (int)data[i * comp + 1];
+            sample.b = (int)data[i * comp + 2];
+
+            float* l = lower + (size_t)i * k;
+
+            if (version == 0)
+            {
+                // No bounds yet, so do a full scan like lloyd.
+                int group = 0;
+                double u = DBL_MAX;
+                for (int c = 0; c < k; c++)
+                {
+                    double d = sqrt(
+                        (double)kmeans_sample_dist2(&centroids[c], &sample));
+                    l[c] = (float)d;
+                    if (d < u)
+                    {
+                        u = d;
+                        group = c;
+                    }
+                }
+                px_centroid[i] = group;
+                upper[i] = (float)u;
+                stamp[i] = 0;
+                evals += k;
+                changed++;
+                continue;
+            }
+
+            // Widen the upper bound by how far the assigned centroid drifted
+            // since the bounds were last moved.
+            int a = px_centroid[i];
+            const float* now = drift + version * k;
+            const float* then = drift + stamp[i] * k;
+            const float slack = KMEANS_BOUND_EPS * (version - stamp[i]);
+            double u = upper[i] + (now[a] - then[a]) + slack;
+
+            if (u < half_near[a]) continue;
+
+            // Move the lower bounds as well, and count the centroids that
+            // they can't rule out.
+            const float u_up = nextafterf((float)u, FLT_MAX);
+            int candidates = 0;
+            for (int c = 0; c < k; c++)
+            {
+                l[c] -= now[c] - then[c] + slack;
+                candidates += l[c] <= u_up;
+            }
+            candidates -= l[a] <= u_up;
+
+            if (candidates == 0)
+            {
+                upper[i] = (float)u;
+                stamp[i] = version;
+                continue;
+            }
+
+            // All comparisons are strict, so a skipped centroid is always
+            // strictly farther than the assigned one. Ties are then resolved
+            // towards the lower index, same as in lloyd.
+            bool tight = false;
+            for (int c = 0; c < k; c++)
+            {
+                if (c == a || u < l[c] || u < half_dist[a * k + c]) continue;
+
+                if (!tight)
+                {
+                    u = sqrt(
+                        (double)kmeans_sample_dist2(&centroids[a], &sample));
+                    l[a] = (float)u;
+                    tight = true;
+                    evals++;
+                    if (u < l[c] || u < half_dist[a * k + c]) continue;
+                }
+
+                double d =
+                    sqrt((double)kmeans_sample_dist2(&centroids[c], &sample));
+                l[c] = (float)d;
+                evals++;
+                if (d < u || (d == u && c < a))
+                {
+                    u = d;
+                    a = c;
+                }
+            }
+
+            changed += px_centroid[i] != a;
+            px_centroid[i] = a;
+            upper[i] = (float)u;
+            stamp[i] = version;
+        }
+
+        // Calculate the new centroid for each pixel group.
+        memset(group_size, 0, k * sizeof(uint64_t));
+        memset(rgb_values, 0, 3 * k * sizeof(uint64_t));
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, k, comp, data, px_centroid)                                      \
+    reduction(+ : group_size[:k], rgb_values[:3 * k])
+        for (int i = 0; i < n; i++)
+        {
+            group_size[px_centroid[i]]++;
+            rgb_values[px_centroid[i] * 3 + 0] += data[i * comp + 0];
+            rgb_values[px_centroid[i] * 3 + 1] += data[i * comp + 1];
+            rgb_values[px_centroid[i] * 3 + 2] += data[i * comp + 2];
+        }
+
+        // Average out all the pixel values and record the drift.
+        double shift = kmeans_update_centroids(
+            kmn, group_size, rgb_values, drift + iter * k);
+        for (int c = 0; c < k; c++)
+        {
+            drift[iter * k + c] += drift[(iter - 1) * k + c];
+        }
+
+        if (kmeans_converged(kmn, iter, shift, changed, n)) break;
     }
 
-    (*img_out)->width = (*img_in)->width;
-    (*img_out)->height = (*img_in)->height;
-    (*img_out)->comp = 4;
-    (*img_out)->size_pixels = (*img_in)->size_pixels;
-    (*img_out)->size_bytes =
-        (*img_in)->width * (*img_in)->height * (*img_out)->comp;
-    (*img_out)->DATA =
-        (uint8_t*)malloc((*img_out)->size_bytes * sizeof(uint8_t));
+    free(upper);
+    free(lower);
+    free(stamp);
+    free(half_dist);
+    free(half_near);
+    free(drift);
+    free(group_size);
+    free(rgb_values);
+
+    printf("end clustering...\n");
+
+    (*kmn)->dist_total = (uint64_t)n * k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = evals;
+    kmeans_report(kmn);
+
+    for (int c = 0; c < k; c++)
+    {
+        printf("c%d: %d, %d, %d\n",
+               c,
+               centroids[c].r,
+               centroids[c].g,
+               centroids[c].b);
+    }
+
+    return (*kmn);
+}
+
+kmean_t* kmeans_cluster_hamerly(kmean_t** kmn, image_t** img, int threads)
+{
+    assert(*kmn != NULL);
+    assert(*img != NULL);
+
+    const int k = (*kmn)->k;
+    const int n = (*img)->size_pixels;
+    const int comp = (*img)->comp;
+    const uint8_t* data = (*img)->DATA;
+    kmean_sample_t* centroids = (*kmn)->centroids;
+    simd_label_t* px_centroid = (*kmn)->px_centroid;
+
+    printf("begin hamerly clustering with %d threads...\n", threads);
+    printf("hamerly bounds use %f MB\n", (double)n * 2 * sizeof(float) / 1e6);
+
+    kmeans_seed(kmn, img);
+
+    // Per pixel: an upper bound on the distance to the assigned centroid and a
+    // lower bound on the distance to any other centroid.
+    float* upper = (float*)malloc(n * sizeof(float));
+    float* lower = (float*)malloc(n * sizeof(float));
+    // For each centroid half the distance to its nearest other centroid.
+    double* half_near = (double*)malloc(k * sizeof(double));
+    // How far each centroid moved in the last update step.
+    float* drift = (float*)calloc(k, sizeof(float));
+
+    uint64_t* group_size = (uint64_t*)calloc(k, sizeof(uint64_t));
+    uint64_t* rgb_values = (uint64_t*)calloc(3 * k, sizeof(uint64_t));
+    uint64_t evals = 0;
+
+    int iter = 0;
+    while (iter++ < (*kmn)->iter)
+    {
+        printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
+
+        // The lower bound moves by the largest drift among the other
+        // centroids, so keep the two largest.
+        int drift_max_idx = 0;
+        float drift_max = 0.0f;
+        float drift_second = 0.0f;
+        for (int c = 0; c < k; c++)
+        {
+            if (drift[c] > drift_max)
+            {
+                drift_second = drift_max;
+                drift_max = drift[c];
+                drift_max_idx = c;
+            }
+            else if (drift[c] > drift_second)
+            {
+                drift_second = drift[c];
+            }
+
+            half_near[c] = DBL_MAX;
+            for (int o = 0; o < k; o++)
+            {
+                if (o == c) continue;
+                double d = 0.5 * sqrt((double)kmeans_sample_dist2(
+                                     &centroids[c], &centroids[o]));
+                if (d < half_near[c]) half_near[c] = d;
+            }
+        }
+
+        const bool first = iter == 1;
+        uint64_t changed = 0;
+
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, k, comp, data, centroids, px_centroid, upper, lower, half_near,  \
+               drift, drift_max_idx, drift_max, drift_second, first)           \
+    reduction(+ : evals, changed)
+        for (int i = 0; i < n; i++)
+        {
+            kmean_sample_t sample;
+            sample.r = (int)data[i * comp + 0];
+            sample.g = (int)data[i * comp + 1];
+            sample.b = (int)data[i * comp + 2];
+
+            if (!first)
+            {
+                // Move the bounds by how far the centroids drifted.
+                int a = px_centroid[i];
+                double u = upper[i] + drift[a] + KMEANS_BOUND_EPS;
+                double l = lower[i] -
+                           (a == drift_max_idx ? drift_second : drift_max) -
+                           KMEANS_BOUND_EPS;
+
+                // Comparisons are strict, so when a pixel is skipped every
+                // other centroid is strictly farther than the assigned one.
+                double m = l > half_near[a] ? l : half_near[a];
+                if (u >= m)
+                {
+                    u = sqrt(
+                        (double)kmeans_sample_dist2(&centroids[a], &sample));
+                    evals++;
+                }
+
+                if (u < m)
+                {
+                    upper[i] = (float)u;
+                    lower[i] = (float)l;
+                    continue;
+                }
+            }
+
+            // Full scan for the nearest and second nearest centroid, ties go
+            // to the lower index like in lloyd.
+            int best = INT_MAX;
+            int second = INT_MAX;
+            int group = 0;
+            for (int c = 0; c < k; c++)
+            {
+                int d = kmeans_sample_dist2(&centroids[c], &sample);
+                if (d < best)
+                {
+                    second = best;
+                    best = d;
+                    group = c;
+                }
+                else if (d < second)
+                {
+                    second = d;
+                }
+            }
+            evals += k;
+
+            changed += first || px_centroid[i] != group;
+            px_centroid[i] = group;
+            upper[i] = (float)sqrt((double)best);
+            lower[i] = (float)sqrt((double)second);
+        }
+
+        // Calculate the new centroid for each pixel group.
+        memset(group_size, 0, k * sizeof(uint64_t));
+        memset(rgb_values, 0, 3 * k * sizeof(uint64_t));
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, k, comp, data, px_centroid)                                      \
+    reduction(+ : group_size[:k], rgb_values[:3 * k])
+        for (int i = 0; i < n; i++)
+        {
+            group_size[px_centroid[i]]++;
+            rgb_values[px_centroid[i] * 3 + 0] += data[i * comp + 0];
+            rgb_values[px_centroid[i] * 3 + 1] += data[i * comp + 1];
+            rgb_values[px_centroid[i] * 3 + 2] += data[i * comp + 2];
+        }
+
+        // Average out all the pixel values and record the drift.
+        double shift =
+            kmeans_update_centroids(kmn, group_size, rgb_values, drift);
+        if (kmeans_converged(kmn, iter, shift, changed, n)) break;
+    }
+
+    free(upper);
+    free(lower);
+    free(half_near);
+    free(drift);
+    free(group_size);
+    free(rgb_values);
+
+    printf("end clustering...\n");
+
+    (*kmn)->dist_total = (uint64_t)n * k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = evals;
+    kmeans_report(kmn);
+
+    for (int c = 0; c < k; c++)
+    {
+        printf("c%d: %d, %d, %d\n",
+               c,
+               centroids[c].r,
+               centroids[c].g,
+               centroids[c].b);
+    }
+
+    return (*kmn);
+}
+
+kmean_t* kmeans_cluster_hist(kmean_t** kmn, image_t** img, int threads)
+{
+    assert(*kmn != NULL);
+    assert(*img != NULL);
+
+    printf("begin %s clustering with %d threads...\n",
+           kmeans_mode_name((*kmn)->mode),
+           threads);
+    if ((*kmn)->algo != KMEANS_ALGO_LLOYD)
+    {
+        printf("%s is not used in %s mode, running weighted lloyd\n",
+               kmeans_algo_name((*kmn)->algo),
+               kmeans_mode_name((*kmn)->mode));
+    }
+
+    if ((*kmn)->hist == NULL && (*kmn)->mode == KMEANS_MODE_HIST)
+    {
+        hist_init(&(*kmn)->hist, img);
+    }
+    else if ((*kmn)->hist == NULL)
+    {
+        hist_init_cube(
+            &(*kmn)->hist, img, (*kmn)->mode == KMEANS_MODE_CUBE5 ? 5 : 6);
+    }
+
+    const int k = (*kmn)->k;
+    const hist_t* hist = (*kmn)->hist;
+    const int n = hist->size;
+    kmean_sample_t* centroids = (*kmn)->centroids;
+
+    (*kmn)->hist_centroid =
+        (int*)realloc((*kmn)->hist_centroid, n * sizeof(int));
+    int* hist_centroid = (*kmn)->hist_centroid;
+
+    kmeans_seed(kmn, img);
+
+    uint64_t* group_size = (uint64_t*)calloc(k, sizeof(uint64_t));
+    uint64_t* rgb_values = (uint64_t*)calloc(3 * k, sizeof(uint64_t));
+
+    int iter = 0;
+    while (iter++ < (*kmn)->iter)
+    {
+        printf("processing iteration %d/%d...\n", iter, (*kmn)->iter);
+
+        // Assign each table entry to its nearest centroid, and add all of
+        // the pixels it stands for to that centroid.
+        uint64_t changed = 0;
+        memset(group_size, 0, k * sizeof(uint64_t));
+        memset(rgb_values, 0, 3 * k * sizeof(uint64_t));
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, k, hist, centroids, hist_centroid, iter)                         \
+    reduction(+ : group_size[:k], rgb_values[:3 * k], changed)
+        for (int e = 0; e < n; e++)
+        {
+            kmean_sample_t sample;
+            sample.r = (int)hist->colors[e * 3 + 0];
+            sample.g = (int)hist->colors[e * 3 + 1];
+            sample.b = (int)hist->colors[e * 3 + 2];
+
+            int euclid = INT_MAX;
+            int group = 0;
+            for (int c = 0; c < k; c++)
+            {
+                int d = kmeans_sample_dist2(&centroids[c], &sample);
+                if (d < euclid)
+                {
+                    euclid = d;
+                    group = c;
+                }
+            }
+
+            if (iter == 1 || hist_centroid[e] != group)
+            {
+                changed += hist->counts[e];
+            }
+            hist_centroid[e] = group;
+            group_size[group] += hist->counts[e];
+            rgb_values[group * 3 + 0] += hist->sums[e * 3 + 0];
+            rgb_values[group * 3 + 1] += hist->sums[e * 3 + 1];
+            rgb_values[group * 3 + 2] += hist->sums[e * 3 + 2];
+        }
+
+        // Average out all the pixel values.
+        double shift =
+            kmeans_update_centroids(kmn, group_size, rgb_values, NULL);
+        if (kmeans_converged(
+                kmn, iter, shift, changed, (*img)->size_pixels))
+            break;
+    }
+
+    free(group_size);
+    free(rgb_values);
+
+    printf("end clustering...\n");
+
+    (*kmn)->dist_total = (uint64_t)(*img)->size_pixels * k * (*kmn)->iter_done;
+    (*kmn)->dist_evals = (uint64_t)n * k * (*kmn)->iter_done;
+    kmeans_report(kmn);
+
+    for (int c = 0; c < k; c++)
+    {
+        printf("c%d: %d, %d, %d\n",
+               c,
+               centroids[c].r,
+               centroids[c].g,
+               centroids[c].b);
+    }
+
+    return (*kmn);
+}
+
+kmean_t* kmeans_label_pixels(kmean_t** kmn, image_t** img, int threads)
+{
+    assert(*kmn != NULL);
+    assert(*img != NULL);
+    assert((*kmn)->hist != NULL);
+
+    const int k = (*kmn)->k;
+    const int n = (*img)->size_pixels;
+    const int comp = (*img)->comp;
+    const uint8_t* data = (*img)->DATA;
+    const kmean_sample_t* centroids = (*kmn)->centroids;
+    simd_label_t* px_centroid = (*kmn)->px_centroid;
+    const int* hist_centroid = (*kmn)->hist_centroid;
+    hist_t* hist = (*kmn)->hist;
+
+    if (hist->bits > 0)
+    {
+        // Bins are coarser than the pixels, so map each full precision pixel
+        // to its nearest centroid.
+        printf("labeling pixels with nearest centroid...\n");
+
+        simd_centroids_t* soa = NULL;
+        simd_centroids_init(&soa, k);
+        simd_centroids_load(&soa, (const int*)centroids);
+
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, comp, data, px_centroid, soa)
+        for (int i = 0; i < n; i += KMEANS_SIMD_BLOCK)
+        {
+            int end = i + KMEANS_SIMD_BLOCK < n ? i + KMEANS_SIMD_BLOCK : n;
+            simd_assign(soa, data, comp, i, end, px_centroid, true);
+        }
+
+        simd_centroids_free(&soa);
+
+        return (*kmn);
+    }
+
+    printf("labeling pixels through the color table...\n");
+
+#pragma omp parallel for num_threads(threads) schedule(static) default(none) \
+    shared(n, comp, data, px_centroid, hist_centroid, hist)
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t* px = data + i * comp;
+        px_centroid[i] = hist_centroid[hist_find(&hist, px[0], px[1], px[2])];
+    }
+
+    return (*kmn);
+}
+
+double kmeans_update_centroids(kmean_t** kmn,
+                               const uint64_t* group_size,
+                               const uint64_t* rgb_values,
+                               float* drift)
+{
+    assert(*kmn != NULL);
+
+    double shift = 0.0;
+    for (int c = 0; c < (*kmn)->k; c++)
+    {
+        if (drift != NULL) drift[c] = 0.0f;
+        if (group_size[c] == 0) continue;
+
+        kmean_sample_t centroid;
+        centroid.r = (int)(rgb_values[c * 3 + 0] / group_size[c]);
+        centroid.g = (int)(rgb_values[c * 3 + 1] / group_size[c]);
+        centroid.b = (int)(rgb_values[c * 3 + 2] / group_size[c]);
+
+        double d = sqrt(
+            (double)kmeans_sample_dist2(&(*kmn)->centroids[c], &centroid));
+        if (drift != NULL) drift[c] = (float)d;
+        if (d > shift) shift = d;
+
+        (*kmn)->centroids[c] = centroid;
+    }
+
+    return shift;
+}
+
+bool kmeans_converged(kmean_t** kmn,
+                      int iter,
+                      double shift,
+                      uint64_t changed,
+                      uint64_t total)
+{
+    assert(*kmn != NULL);
+
+    (*kmn)->iter_done = iter;
+
+    double frac = total > 0 ? (double)changed / total : 0.0;
+    printf("max centroid shift %f, %f%% of pixels changed cluster\n",
+           shift,
+           100.0 * frac);
+
+    bool done = shift <= (*kmn)->tol || frac <= (*kmn)->min_changed;
+    if (done && iter < (*kmn)->iter)
+    {
+        printf("converged after %d iterations\n", iter);
+    }
+
+    return done;
+}
+
+void kmeans_report(kmean_t** kmn)
+{
+    assert(*kmn != NULL);
+
+    printf("iterations: %d run, %d budgeted\n",
+           (*kmn)->iter_done,
+           (*kmn)->iter);
+
+    uint64_t skipped = (*kmn)->dist_total - (*kmn)->dist_evals;
+    printf("distance evaluations: %lu computed, %lu skipped (%.2f%%)\n",
+           (unsigned long)(*kmn)->dist_evals,
+           (unsigned long)skipped,
+           (*kmn)->dist_total > 0 ? 100.0 * skipped / (*kmn)->dist_total
+                                  : 0.0);
+}
+
+kmean_t* kmeans_image_multithr(kmean_t** kmn,
+                               image_t** img_in,
+                               image_t** img_out,
+                               int threads)
+{
+    assert(*kmn != NULL);
+    assert(*img_in != NULL);
+
+    printf("writing image data with %d threads...\n", threads);
+
+    if ((*kmn)->mode != KMEANS_MODE_PIXEL)
+    {
+        kmeans_label_pixels(kmn, img_in, threads);
+    }
+
+    omp_set_num_threads(threads);
+
+    kmeans_image_alloc(kmn, img_in, img_out, true);
+    uint32_t* palette = kmeans_palette(kmn);
 
 #pragma omp parallel for schedule(dynamic) \
-    shared(img_in, img_out, kmn) default(none)
-    for (int i = 0; i < (*img_in)->size_pixels; i++)
+    shared(img_in, img_out, kmn, palette) default(none)
+    for (int i = 0; i < (*img_in)->size_pixels; i += KMEANS_SIMD_BLOCK)
     {
-        (*img_out)->DATA[i * 4 + 0] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].r;
-        (*img_out)->DATA[i * 4 + 1] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].g;
-        (*img_out)->DATA[i * 4 + 2] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].b;
-        (*img_out)->DATA[i * 4 + 3] = 255;
+        int end = i + KMEANS_SIMD_BLOCK < (*img_in)->size_pixels
+                      ? i + KMEANS_SIMD_BLOCK
+                      : (*img_in)->size_pixels;
+        kmeans_image_range(kmn, palette, i, end, (*img_out)->DATA);
     }
 
+    kmeans_image_palette(kmn, img_out, palette);
+
     return (*kmn);
 }
 
@@ -475,6 +1781,32 @@ kmean_t* kmeans_image(kmean_t** kmn, image_t** img_in, image_t** img_out)
 
     printf("writing image data...\n");
 
+    if ((*kmn)->mode != KMEANS_MODE_PIXEL)
+    {
+        kmeans_label_pixels(kmn, img_in, 1);
+    }
+
+    kmeans_image_alloc(kmn, img_in, img_out, true);
+    uint32_t* palette = kmeans_palette(kmn);
+    kmeans_image_range(
+        kmn, palette, 0, (*img_in)->size_pixels, (*img_out)->DATA);
+    kmeans_image_palette(kmn, img_out, palette);
+
+    return (*kmn);
+}
+
+// Sets up the output image in the output pixel format, with room for every
+// pixel. Index output with byte labels is the labels themselves, so with
+// borrow_labels it points at px_centroid instead, which has to outlive it.
+image_t* kmeans_image_alloc(kmean_t** kmn,
+                            image_t** img_in,
+                            image_t** img_out,
+                            bool borrow_labels)
+{
+    assert(*kmn != NULL);
+    assert(*img_in != NULL);
+    assert((*kmn)->out != KMEANS_OUT_INDEX || (*kmn)->k <= PNG_MAX_PALETTE);
+
     if (*img_out == NULL)
     {
         *img_out = (image_t*)realloc(*img_out, sizeof(image_t));
@@ -482,25 +1814,100 @@ kmean_t* kmeans_image(kmean_t** kmn, image_t** img_in, image_t** img_out)
 
     (*img_out)->width = (*img_in)->width;
     (*img_out)->height = (*img_in)->height;
-    (*img_out)->comp = 4;
+    (*img_out)->comp = kmeans_out_comp((*kmn)->out);
     (*img_out)->size_pixels = (*img_in)->size_pixels;
     (*img_out)->size_bytes =
         (*img_in)->width * (*img_in)->height * (*img_out)->comp;
+    (*img_out)->palette = NULL;
+    (*img_out)->palette_size = 0;
+    (*img_out)->map = NULL;
+    (*img_out)->map_size = 0;
+
+#if SIMD_MAX_K <= 256
+    if (borrow_labels && (*kmn)->out == KMEANS_OUT_INDEX)
+    {
+        (*img_out)->DATA = (*kmn)->px_centroid;
+        (*img_out)->owner = IMAGE_OWNER_NONE;
+        return (*img_out);
+    }
+#else
+    (void)borrow_labels;
+#endif
+
     (*img_out)->DATA =
         (uint8_t*)malloc((*img_out)->size_bytes * sizeof(uint8_t));
+    (*img_out)->owner = IMAGE_OWNER_MALLOC;
 
-    for (int i = 0; i < (*img_in)->size_pixels; i++)
+    return (*img_out);
+}
+
+// Index images keep the palette, so they are written as indexed-color PNGs.
+// Takes ownership of the palette.
+void kmeans_image_palette(kmean_t** kmn, image_t** img_out, uint32_t* palette)
+{
+    if ((*kmn)->out == KMEANS_OUT_INDEX)
     {
-        (*img_out)->DATA[i * 4 + 0] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].r;
-        (*img_out)->DATA[i * 4 + 1] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].g;
-        (*img_out)->DATA[i * 4 + 2] =
-            (*kmn)->centroids[(*kmn)->px_centroid[i]].b;
-        (*img_out)->DATA[i * 4 + 3] = 255;
+        (*img_out)->palette = palette;
+        (*img_out)->palette_size = (*kmn)->k;
     }
+    else
+    {
+        free(palette);
+    }
+}
 
-    return (*kmn);
+// Writes the output pixels of [begin, end) from the labels. RGBA goes through
+// the SIMD palette lookup, the narrower formats are written byte by byte.
+void kmeans_image_range(kmean_t** kmn,
+                        const uint32_t* _palette,
+                        int begin,
+                        int end,
+                        uint8_t* data)
+{
+    const simd_label_t* px_centroid = (*kmn)->px_centroid;
+
+    switch ((*kmn)->out)
+    {
+    case KMEANS_OUT_RGB:
+        for (int i = begin; i < end; i++)
+        {
+            memcpy(&data[i * 3], &_palette[px_centroid[i]], 3);
+        }
+        break;
+    case KMEANS_OUT_INDEX:
+        // Byte labels are the output already, see kmeans_image_alloc.
+#if SIMD_MAX_K > 256
+        for (int i = begin; i < end; i++)
+        {
+            data[i] = (uint8_t)px_centroid[i];
+        }
+#else
+        assert(data == px_centroid);
+#endif
+        break;
+    default:
+        simd_map(_palette, px_centroid, begin, end, (uint32_t*)data);
+        break;
+    }
+}
+
+// Packs each centroid into an RGBA pixel, in memory order, so the output
+// image can be written one 32-bit palette entry per pixel.
+uint32_t* kmeans_palette(kmean_t** kmn)
+{
+    assert(*kmn != NULL);
+
+    uint32_t* palette = (uint32_t*)malloc((*kmn)->k * sizeof(uint32_t));
+    for (int k = 0; k < (*kmn)->k; k++)
+    {
+        uint8_t rgba[4] = {(uint8_t)(*kmn)->centroids[k].r,
+                           (uint8_t)(*kmn)->centroids[k].g,
+                           (uint8_t)(*kmn)->centroids[k].b,
+                           255};
+        memcpy(&palette[k], rgba, sizeof(rgba));
+    }
+
+    return palette;
 }
 
 void kmeans_free(kmean_t** kmn)
@@ -508,6 +1915,8 @@ void kmeans_free(kmean_t** kmn)
     assert(*kmn != NULL);
     free((*kmn)->centroids);
     free((*kmn)->px_centroid);
+    if ((*kmn)->hist != NULL) hist_free(&(*kmn)->hist);
+    free((*kmn)->hist_centroid);
     free(*kmn);
 }
 
@@ -531,3 +1940,137 @@ inline double kmeans_sample_euclid2(kmean_sample_t* sample1,
 
     return pow((double)r, 2) + pow((double)g, 2) + pow((double)b, 2);
 }
+
+static inline int kmeans_sample_dist2(const kmean_sample_t* sample1,
+                                      const kmean_sample_t* sample2)
+{
+    int r = sample1->r - sample2->r;
+    int g = sample1->g - sample2->g;
+    int b = sample1->b - sample2->b;
+
+    return r * r + g * g + b * b;
+}
+
+int kmeans_algo_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "lloyd") == 0) return KMEANS_ALGO_LLOYD;
+    if (strcmp(_name, "elkan") == 0) return KMEANS_ALGO_ELKAN;
+    if (strcmp(_name, "hamerly") == 0) return KMEANS_ALGO_HAMERLY;
+
+    return -1;
+}
+
+const char* kmeans_algo_name(kmean_algo_t algo)
+{
+    switch (algo)
+    {
+    case KMEANS_ALGO_LLOYD:
+        return "lloyd";
+    case KMEANS_ALGO_ELKAN:
+        return "elkan";
+    case KMEANS_ALGO_HAMERLY:
+        return "hamerly";
+    default:
+        return "unknown";
+    }
+}
+
+int kmeans_mode_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "pixel") == 0) return KMEANS_MODE_PIXEL;
+    if (strcmp(_name, "hist") == 0) return KMEANS_MODE_HIST;
+    if (strcmp(_name, "cube5") == 0) return KMEANS_MODE_CUBE5;
+    if (strcmp(_name, "cube6") == 0) return KMEANS_MODE_CUBE6;
+
+    return -1;
+}
+
+const char* kmeans_mode_name(kmean_mode_t mode)
+{
+    switch (mode)
+    {
+    case KMEANS_MODE_PIXEL:
+        return "pixel";
+    case KMEANS_MODE_HIST:
+        return "hist";
+    case KMEANS_MODE_CUBE5:
+        return "cube5";
+    case KMEANS_MODE_CUBE6:
+        return "cube6";
+    default:
+        return "unknown";
+    }
+}
+
+int kmeans_out_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "rgba") == 0) return KMEANS_OUT_RGBA;
+    if (strcmp(_name, "rgb") == 0) return KMEANS_OUT_RGB;
+    if (strcmp(_name, "index") == 0) return KMEANS_OUT_INDEX;
+
+    return -1;
+}
+
+const char* kmeans_out_name(kmean_out_t out)
+{
+    switch (out)
+    {
+    case KMEANS_OUT_RGBA:
+        return "rgba";
+    case KMEANS_OUT_RGB:
+        return "rgb";
+    case KMEANS_OUT_INDEX:
+        return "index";
+    default:
+        return "unknown";
+    }
+}
+
+// Bytes per pixel of the output format.
+int kmeans_out_comp(kmean_out_t out)
+{
+    switch (out)
+    {
+    case KMEANS_OUT_RGB:
+        return 3;
+    case KMEANS_OUT_INDEX:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
+int kmeans_schedule_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "static") == 0) return omp_sched_static;
+    if (strcmp(_name, "dynamic") == 0) return omp_sched_dynamic;
+    if (strcmp(_name, "guided") == 0) return omp_sched_guided;
+    if (strcmp(_name, "auto") == 0) return omp_sched_auto;
+
+    return -1;
+}
+
+const char* kmeans_schedule_name(omp_sched_t schedule)
+{
+    switch (schedule)
+    {
+    case omp_sched_static:
+        return "static";
+    case omp_sched_dynamic:
+        return "dynamic";
+    case omp_sched_guided:
+        return "guided";
+    case omp_sched_auto:
+        return "auto";
+    default:
+        return "unknown";
+    }
+}
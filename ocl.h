@@ -4,8 +4,14 @@
 
 #include <CL/cl.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define CL_CHECK_ERR(ret)                       \
     if ((ret) < 0)                                \
@@ -18,10 +24,46 @@
 
 static cl_int CL_RET;
 
+// Program binaries are cached under $XDG_CACHE_HOME/cl-kmeans, or
+// ~/.cache/cl-kmeans when it is not set.
+#define CL_CACHE_DIR "cl-kmeans"
+#define CL_FNV_OFFSET 0xcbf29ce484222325ull
+#define CL_FNV_PRIME 0x100000001b3ull
+
+// Unfinished profiled commands are collected up to this many, before waiting
+// for them to read their timings.
+#define CL_PROFILE_PENDING_MAX 256
+
+// Host memory a device uses in place is page aligned, and sized in whole
+// pages, which meets the alignment every zero-copy driver asks for.
+#define CL_HOST_ALIGN 4096
+
+typedef enum cl_profile_format_t
+{
+    CL_PROFILE_OFF,
+    CL_PROFILE_TABLE,
+    CL_PROFILE_JSON,
+} cl_profile_format_t;
+
+// Profiling totals of one kernel, or of one kind of transfer on one buffer,
+// in nanoseconds. Queued is the time between enqueueing a command and
+// submitting it to the device, submit the time until it started running.
+typedef struct cl_profile_t
+{
+    char name[64];
+    bool transfer;
+    int calls;
+    uint64_t bytes;
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong run;
+} cl_profile_t;
+
 typedef struct cl_xpair_t
 {
     cl_program program;
     cl_kernel kernel;
+    char* name;
 
     int kernel_arg_count;
     int kernel_arg_prim_count;
@@ -36,14 +78,57 @@ typedef struct cl_env_t
     cl_context context;
     cl_command_queue command_queue;
 
+    // Path of an OpenCL source file to build instead of the sources embedded
+    // at build time, or NULL.
+    const char* source_path;
+
+    // The device shares memory with the host, so buffers are created over
+    // host memory with CL_MEM_USE_HOST_PTR and mapped instead of copied.
+    bool zero_copy;
+
     int program_count;
     int xpair_count;
     cl_program* programs;
-    cl_xpair_t* xpairs;
+    // Hash of the source and build options of each program, so a variant is
+    // only built once per environment.
+    uint64_t* program_keys;
+    // Execution pairs are allocated one by one, so pointers handed out by
+    // cl_create_kernel stay valid as more kernels are created.
+    cl_xpair_t** xpairs;
+
+    // With profiling on, every enqueue records an event. Timings are added to
+    // the profile of its kernel or transfer once the command has finished.
+    cl_profile_format_t profile_format;
+    int profile_count;
+    cl_profile_t* profiles;
+    int pending_count;
+    cl_event pending_events[CL_PROFILE_PENDING_MAX];
+    int pending_profiles[CL_PROFILE_PENDING_MAX];
+
+    // Buffer names used in the profile of transfers.
+    int mem_label_count;
+    cl_mem* mem_label_objs;
+    char** mem_labels;
 } cl_env_t;
 
-cl_env_t* cl_init(cl_env_t** env);
-cl_program* cl_create_program(cl_env_t** env, const char* _source);
+cl_env_t* cl_init(cl_env_t** env,
+                  int platform,
+                  int device,
+                  cl_device_type device_type);
+void cl_list_devices(cl_device_type device_type);
+cl_program* cl_create_program(cl_env_t** env,
+                              const char* _source,
+                              const char* _options);
+uint64_t cl_fnv1a(uint64_t hash, const void* _data, size_t size);
+uint64_t cl_program_key(const char* _source, const char* _options);
+uint64_t cl_device_key(cl_env_t** env);
+char* cl_cache_file(const char* _name);
+char* cl_cache_path(cl_env_t** env, uint64_t program_key);
+cl_program cl_cache_load(cl_env_t** env,
+                         const char* _path,
+                         const char* _options);
+void cl_cache_store(cl_env_t** env, cl_program program, const char* _path);
+void cl_print_build_log(cl_env_t** env, cl_program program);
 cl_xpair_t* cl_create_kernel(cl_env_t** env,
                              cl_program* program,
                              const char* _name);
@@ -57,47 +142,140 @@ cl_xpair_t* cl_add_kernel_arg_prim(cl_env_t** env,
                                    cl_uint position,
                                    size_t size,
                                    const void* _ptr);
+cl_xpair_t* cl_add_kernel_arg_local(cl_env_t** env,
+                                    cl_xpair_t* execution_pair,
+                                    cl_uint position,
+                                    size_t size);
+size_t cl_kernel_size_multiple(cl_env_t** env, cl_xpair_t* execution_pair);
+size_t cl_kernel_local_size(cl_env_t** env, cl_xpair_t* execution_pair);
+size_t cl_global_size(size_t work_items, size_t local_size);
 cl_xpair_t* cl_enqueue_kernel(cl_env_t** env,
                               cl_xpair_t* execution_pair,
                               cl_uint work_dimensions,
                               const size_t* _global_work_size,
                               const size_t* _local_work_size,
                               cl_event* event);
+cl_ulong cl_event_elapsed(cl_event* event);
 void* cl_read_buffer(cl_env_t** env,
                      cl_mem* source_mem_obj,
                      cl_bool blocking_read,
                      size_t size,
                      void* ptr);
+void cl_write_buffer(cl_env_t** env,
+                     cl_mem* target_mem_obj,
+                     cl_bool blocking_write,
+                     size_t size,
+                     const void* _ptr);
+void cl_fill_buffer(cl_env_t** env,
+                    cl_mem* mem_obj,
+                    const void* _pattern,
+                    size_t pattern_size,
+                    size_t size);
+void* cl_map_buffer(cl_env_t** env,
+                    cl_mem* mem_obj,
+                    cl_map_flags map_flags,
+                    size_t size);
+void cl_unmap_buffer(cl_env_t** env, cl_mem* mem_obj, void* ptr);
+void* cl_host_alloc(size_t size);
+bool cl_host_aligned(const void* _ptr);
+bool cl_device_extension(cl_env_t** env, const char* _name);
+void cl_label_mem_obj(cl_env_t** env, cl_mem mem_obj, const char* _label);
+int cl_profile_find(cl_env_t** env, const char* _name, bool transfer);
+int cl_profile_transfer(cl_env_t** env, const char* _kind, cl_mem mem_obj);
+void cl_profile_record(cl_env_t** env, int profile, cl_event event);
+void cl_profile_add(cl_env_t** env, int profile, cl_event event);
+void cl_profile_flush(cl_env_t** env);
+void cl_profile_report(cl_env_t** env);
 void cl_free(cl_env_t** env);
 const char* cl_error_string(cl_int err);
-
-cl_env_t* cl_init(cl_env_t** env)
+int cl_profile_format_parse(const char* _name);
+const char* cl_profile_format_name(cl_profile_format_t format);
+cl_device_type cl_device_type_parse(const char* _name);
+const char* cl_device_type_name(cl_device_type device_type);
+
+// Picks the device-th device of device_type on the given platform. A negative
+// platform picks the first platform that has such a device.
+cl_env_t* cl_init(cl_env_t** env,
+                  int platform,
+                  int device,
+                  cl_device_type device_type)
 {
     if (*env == NULL)
     {
         *env = (cl_env_t*)realloc(*env, sizeof(cl_env_t));
     }
 
+    (*env)->source_path = NULL;
+    (*env)->zero_copy = false;
     (*env)->program_count = 0;
     (*env)->programs = NULL;
+    (*env)->program_keys = NULL;
     (*env)->xpair_count = 0;
     (*env)->xpairs = NULL;
+    (*env)->profile_format = CL_PROFILE_OFF;
+    (*env)->profile_count = 0;
+    (*env)->profiles = NULL;
+    (*env)->pending_count = 0;
+    (*env)->mem_label_count = 0;
+    (*env)->mem_label_objs = NULL;
+    (*env)->mem_labels = NULL;
+
+    cl_uint ret_num_platforms = 0;
+    CL_RET = clGetPlatformIDs(0, NULL, &ret_num_platforms);
+    CL_CHECK_ERR(CL_RET);
+    if (ret_num_platforms == 0 || (int)ret_num_platforms <= platform)
+    {
+        fprintf(stderr,
+                "no cl platform %d, found %d platforms\n",
+                platform,
+                ret_num_platforms);
+        exit(1);
+    }
 
-    cl_platform_id platform_id;
-    cl_uint ret_num_platforms;
-    CL_RET = clGetPlatformIDs(1, &platform_id, &ret_num_platforms);
+    cl_platform_id* platform_ids =
+        (cl_platform_id*)malloc(ret_num_platforms * sizeof(cl_platform_id));
+    CL_RET = clGetPlatformIDs(ret_num_platforms, platform_ids, NULL);
     CL_CHECK_ERR(CL_RET);
-    assert(ret_num_platforms > 0);
 
-    (*env)->platform_id = platform_id;
+    int first = platform < 0 ? 0 : platform;
+    int last = platform < 0 ? (int)ret_num_platforms - 1 : platform;
+    cl_platform_id platform_id = NULL;
+    cl_device_id device_id = NULL;
+    cl_uint ret_num_devices = 0;
 
-    cl_device_id device_id;
-    cl_uint ret_num_devices;
-    CL_RET = clGetDeviceIDs(
-        platform_id, CL_DEVICE_TYPE_GPU, 1, &device_id, &ret_num_devices);
-    CL_CHECK_ERR(CL_RET);
-    assert(ret_num_devices > 0);
+    for (int p = first; p <= last && device_id == NULL; p++)
+    {
+        // Platforms without a device of this type return CL_DEVICE_NOT_FOUND,
+        // which is not an error here.
+        ret_num_devices = 0;
+        clGetDeviceIDs(
+            platform_ids[p], device_type, 0, NULL, &ret_num_devices);
+        if ((int)ret_num_devices <= device) continue;
+
+        cl_device_id* device_ids =
+            (cl_device_id*)malloc(ret_num_devices * sizeof(cl_device_id));
+        CL_RET = clGetDeviceIDs(
+            platform_ids[p], device_type, ret_num_devices, device_ids, NULL);
+        CL_CHECK_ERR(CL_RET);
+
+        platform_id = platform_ids[p];
+        device_id = device_ids[device];
+        free(device_ids);
+    }
 
+    free(platform_ids);
+
+    if (device_id == NULL)
+    {
+        fprintf(stderr,
+                "no cl %s device %d found, list the available devices with "
+                "--cl-list --cl-type=all\n",
+                cl_device_type_name(device_type),
+                device);
+        exit(1);
+    }
+
+    (*env)->platform_id = platform_id;
     (*env)->device_id = device_id;
 
     cl_context context =
@@ -115,31 +293,428 @@ cl_env_t* cl_init(cl_env_t** env)
 
     (*env)->command_queue = command_queue;
 
-    printf("initialized cl environment, platforms=%d gpu_devices=%d\n",
+    char device_name[256] = "";
+    clGetDeviceInfo(
+        device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+
+    // CPU devices always run out of host memory. Integrated GPUs report it
+    // with CL_DEVICE_HOST_UNIFIED_MEMORY, which OpenCL 2.0 deprecated but
+    // drivers still answer.
+    cl_device_type type = 0;
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceInfo(device_id,
+                    CL_DEVICE_HOST_UNIFIED_MEMORY,
+                    sizeof(unified),
+                    &unified,
+                    NULL);
+    (*env)->zero_copy = (type & CL_DEVICE_TYPE_CPU) || unified == CL_TRUE;
+
+    printf("initialized cl environment, platforms=%d %s_devices=%d "
+           "device=%s zero_copy=%d\n",
            ret_num_platforms,
-           ret_num_devices);
+           cl_device_type_name(device_type),
+           ret_num_devices,
+           device_name,
+           (*env)->zero_copy);
 
     return *env;
 }
 
-cl_program* cl_create_program(cl_env_t** env, const char* _source)
+// Prints every device of device_type, numbered the way cl_init picks them.
+void cl_list_devices(cl_device_type device_type)
+{
+    cl_uint ret_num_platforms = 0;
+    clGetPlatformIDs(0, NULL, &ret_num_platforms);
+    if (ret_num_platforms == 0)
+    {
+        printf("no cl platforms found\n");
+        return;
+    }
+
+    cl_platform_id* platform_ids =
+        (cl_platform_id*)malloc(ret_num_platforms * sizeof(cl_platform_id));
+    CL_RET = clGetPlatformIDs(ret_num_platforms, platform_ids, NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    for (cl_uint p = 0; p < ret_num_platforms; p++)
+    {
+        char name[256] = "";
+        char version[256] = "";
+        clGetPlatformInfo(
+            platform_ids[p], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+        clGetPlatformInfo(platform_ids[p],
+                          CL_PLATFORM_VERSION,
+                          sizeof(version),
+                          version,
+                          NULL);
+        printf("platform %u: %s, %s\n", p, name, version);
+
+        cl_uint ret_num_devices = 0;
+        clGetDeviceIDs(
+            platform_ids[p], device_type, 0, NULL, &ret_num_devices);
+        if (ret_num_devices == 0)
+        {
+            printf("    no %s devices\n", cl_device_type_name(device_type));
+            continue;
+        }
+
+        cl_device_id* device_ids =
+            (cl_device_id*)malloc(ret_num_devices * sizeof(cl_device_id));
+        CL_RET = clGetDeviceIDs(
+            platform_ids[p], device_type, ret_num_devices, device_ids, NULL);
+        CL_CHECK_ERR(CL_RET);
+
+        for (cl_uint d = 0; d < ret_num_devices; d++)
+        {
+            cl_device_type type = 0;
+            cl_uint compute_units = 0;
+            cl_ulong global_mem = 0;
+            cl_ulong local_mem = 0;
+            size_t max_work_group = 0;
+            clGetDeviceInfo(
+                device_ids[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+            clGetDeviceInfo(
+                device_ids[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+            clGetDeviceInfo(device_ids[d],
+                            CL_DEVICE_MAX_COMPUTE_UNITS,
+                            sizeof(compute_units),
+                            &compute_units,
+                            NULL);
+            clGetDeviceInfo(device_ids[d],
+                            CL_DEVICE_GLOBAL_MEM_SIZE,
+                            sizeof(global_mem),
+                            &global_mem,
+                            NULL);
+            clGetDeviceInfo(device_ids[d],
+                            CL_DEVICE_LOCAL_MEM_SIZE,
+                            sizeof(local_mem),
+                            &local_mem,
+                            NULL);
+            clGetDeviceInfo(device_ids[d],
+                            CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                            sizeof(max_work_group),
+                            &max_work_group,
+                            NULL);
+
+            printf("    device %u: %s, type=%s compute_units=%u "
+                   "global_mem=%lluMB local_mem=%lluKB max_work_group=%zu\n",
+                   d,
+                   name,
+                   cl_device_type_name(type),
+                   compute_units,
+                   (unsigned long long)(global_mem >> 20),
+                   (unsigned long long)(local_mem >> 10),
+                   max_work_group);
+        }
+
+        free(device_ids);
+    }
+
+    free(platform_ids);
+}
+
+// Returns the program already built in this environment from the same source
+// and build options. Otherwise loads it from the binary cache when there is a
+// usable entry for this device, and builds it from source as a last resort.
+cl_program* cl_create_program(cl_env_t** env,
+                              const char* _source,
+                              const char* _options)
 {
     assert(*env != NULL);
     assert(_source != NULL);
 
+    uint64_t key = cl_program_key(_source, _options);
+    for (int i = 0; i < (*env)->program_count; i++)
+    {
+        if ((*env)->program_keys[i] == key)
+        {
+            printf("reusing cl program %d\n", i);
+            return &((*env)->programs[i]);
+        }
+    }
+
+    char* cache_path = cl_cache_path(env, key);
+    cl_program program = NULL;
+
+    if (cache_path != NULL)
+    {
+        program = cl_cache_load(env, cache_path, _options);
+    }
+
+    if (program != NULL)
+    {
+        printf("loaded program binary from %s\n", cache_path);
+    }
+    else
+    {
+        program = clCreateProgramWithSource(
+            (*env)->context, 1, &_source, NULL, &CL_RET);
+        CL_CHECK_ERR(CL_RET);
+
+        printf("created program...\n");
+
+        cl_int build_ret = clBuildProgram(
+            program, 1, &(*env)->device_id, _options, NULL, NULL);
+        CL_CHECK_ERR(build_ret);
+
+        printf("built program...\n");
+
+        cl_print_build_log(env, program);
+
+        if (build_ret == CL_SUCCESS && cache_path != NULL)
+        {
+            cl_cache_store(env, program, cache_path);
+        }
+    }
+
+    free(cache_path);
+
+    (*env)->program_count++;
+    (*env)->programs = (cl_program*)realloc(
+        (*env)->programs, (*env)->program_count * sizeof(cl_program));
+
+    (*env)->program_keys = (uint64_t*)realloc(
+        (*env)->program_keys, (*env)->program_count * sizeof(uint64_t));
+
+    (*env)->programs[(*env)->program_count - 1] = program;
+    (*env)->program_keys[(*env)->program_count - 1] = key;
+
+    printf("created cl program, count is now %d\n", (*env)->program_count);
+
+    return &((*env)->programs[(*env)->program_count - 1]);
+}
+
+uint64_t cl_fnv1a(uint64_t hash, const void* _data, size_t size)
+{
+    const unsigned char* data = (const unsigned char*)_data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= CL_FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t cl_program_key(const char* _source, const char* _options)
+{
+    uint64_t hash = CL_FNV_OFFSET;
+    hash = cl_fnv1a(
+        hash, _options ? _options : "", _options ? strlen(_options) + 1 : 1);
+    return cl_fnv1a(hash, _source, strlen(_source));
+}
+
+// Hashes platform and device info strings into the cache key. Terminating
+// nulls are hashed too, so adjacent fields can't run into each other.
+static uint64_t cl_hash_platform_info(uint64_t hash,
+                                      cl_platform_id platform_id,
+                                      cl_platform_info param)
+{
+    char value[1024] = "";
+    size_t size = 1;
+    if (clGetPlatformInfo(platform_id, param, sizeof(value), value, &size) !=
+        CL_SUCCESS)
+    {
+        size = 1;
+    }
+    return cl_fnv1a(hash, value, size);
+}
+
+static uint64_t cl_hash_device_info(uint64_t hash,
+                                    cl_device_id device_id,
+                                    cl_device_info param)
+{
+    char value[1024] = "";
+    size_t size = 1;
+    if (clGetDeviceInfo(device_id, param, sizeof(value), value, &size) !=
+        CL_SUCCESS)
+    {
+        size = 1;
+    }
+    return cl_fnv1a(hash, value, size);
+}
+
+// Identifies the platform, device and driver version, for anything cached
+// per device.
+uint64_t cl_device_key(cl_env_t** env)
+{
+    assert(*env != NULL);
+
+    cl_platform_id platform_id = (*env)->platform_id;
+    cl_device_id device_id = (*env)->device_id;
+
+    uint64_t hash = CL_FNV_OFFSET;
+    hash = cl_hash_platform_info(hash, platform_id, CL_PLATFORM_NAME);
+    hash = cl_hash_platform_info(hash, platform_id, CL_PLATFORM_VERSION);
+    hash = cl_hash_device_info(hash, device_id, CL_DEVICE_NAME);
+    hash = cl_hash_device_info(hash, device_id, CL_DEVICE_VERSION);
+    hash = cl_hash_device_info(hash, device_id, CL_DRIVER_VERSION);
+
+    return hash;
+}
+
+// Returns the path of _name in the cache directory, creating the directory if
+// needed, or NULL when there is no cache directory to use. The caller frees
+// the returned path.
+char* cl_cache_file(const char* _name)
+{
+    char dir[FILENAME_MAX];
+    const char* xdg_cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int len;
+
+    if (xdg_cache != NULL && xdg_cache[0] != '\0')
+    {
+        len = snprintf(dir, sizeof(dir), "%s", xdg_cache);
+    }
+    else if (home != NULL && home[0] != '\0')
+    {
+        len = snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    else
+    {
+        return NULL;
+    }
+
+    if (len < 0 || (size_t)len >= sizeof(dir)) return NULL;
+
+    // The parent may not exist yet either, only the last mkdir has to work.
+    mkdir(dir, 0755);
+    size_t dir_len = (size_t)len;
+    len = snprintf(dir + dir_len, sizeof(dir) - dir_len, "/%s", CL_CACHE_DIR);
+    if (len < 0 || dir_len + len >= sizeof(dir)) return NULL;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror("error creating cache directory");
+        return NULL;
+    }
+
+    size_t path_size = strlen(dir) + strlen(_name) + 2;
+    char* path = (char*)malloc(path_size);
+    snprintf(path, path_size, "%s/%s", dir, _name);
+
+    return path;
+}
+
+// Returns the cache file of the program binary for this device and program
+// key, or NULL when there is no cache directory to use. The caller frees the
+// returned path.
+char* cl_cache_path(cl_env_t** env, uint64_t program_key)
+{
+    uint64_t hash = cl_device_key(env);
+    hash = cl_fnv1a(hash, &program_key, sizeof(program_key));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+
+    return cl_cache_file(name);
+}
+
+// Returns the built program from the cache entry at _path, or NULL if there is
+// no entry or the device rejects it.
+cl_program cl_cache_load(cl_env_t** env,
+                         const char* _path,
+                         const char* _options)
+{
+    FILE* fp;
+    if ((fp = fopen(_path, "rb")) == NULL) return NULL;
+
+    unsigned char* binary = NULL;
+    long size = 0;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 &&
+        fseek(fp, 0, SEEK_SET) == 0)
+    {
+        binary = (unsigned char*)malloc(size);
+        if (fread(binary, 1, size, fp) != (size_t)size)
+        {
+            free(binary);
+            binary = NULL;
+        }
+    }
+    fclose(fp);
+
+    if (binary == NULL) return NULL;
+
+    size_t binary_size = (size_t)size;
+    cl_int binary_status = CL_SUCCESS;
+    cl_int ret = CL_SUCCESS;
     cl_program program =
-        clCreateProgramWithSource((*env)->context, 1, &_source, NULL, &CL_RET);
-    CL_CHECK_ERR(CL_RET);
+        clCreateProgramWithBinary((*env)->context,
+                                  1,
+                                  &(*env)->device_id,
+                                  &binary_size,
+                                  (const unsigned char**)&binary,
+                                  &binary_status,
+                                  &ret);
+    free(binary);
+
+    if (ret == CL_SUCCESS && binary_status == CL_SUCCESS)
+    {
+        ret = clBuildProgram(
+            program, 1, &(*env)->device_id, _options, NULL, NULL);
+        if (ret == CL_SUCCESS) return program;
+    }
 
-    printf("created program...\n");
+    fprintf(stderr,
+            "discarding cached program binary %s: %s\n",
+            _path,
+            cl_error_string(ret != CL_SUCCESS ? ret : binary_status));
+    if (program != NULL) clReleaseProgram(program);
 
-    size_t ret_build_log_size = 0;
-    char* build_log = NULL;
+    return NULL;
+}
 
-    CL_RET = clBuildProgram(program, 1, &(*env)->device_id, NULL, NULL, NULL);
+// Writes the program binary to a temporary file and renames it into place, so
+// concurrent runs never see a partially written entry.
+void cl_cache_store(cl_env_t** env, cl_program program, const char* _path)
+{
+    assert(*env != NULL);
+
+    size_t binary_size = 0;
+    CL_RET = clGetProgramInfo(program,
+                              CL_PROGRAM_BINARY_SIZES,
+                              sizeof(size_t),
+                              &binary_size,
+                              NULL);
     CL_CHECK_ERR(CL_RET);
+    if (CL_RET != CL_SUCCESS || binary_size == 0) return;
+
+    unsigned char* binary = (unsigned char*)malloc(binary_size);
+    CL_RET = clGetProgramInfo(program,
+                              CL_PROGRAM_BINARIES,
+                              sizeof(unsigned char*),
+                              &binary,
+                              NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    size_t tmp_size = strlen(_path) + 32;
+    char* tmp_path = (char*)malloc(tmp_size);
+    snprintf(tmp_path, tmp_size, "%s.%ld.tmp", _path, (long)getpid());
+
+    FILE* fp;
+    if (CL_RET == CL_SUCCESS && (fp = fopen(tmp_path, "wb")) != NULL)
+    {
+        size_t written = fwrite(binary, 1, binary_size, fp);
+        if (fclose(fp) == 0 && written == binary_size &&
+            rename(tmp_path, _path) == 0)
+        {
+            printf("stored program binary in %s\n", _path);
+        }
+        else
+        {
+            perror("error writing program cache");
+            remove(tmp_path);
+        }
+    }
 
-    printf("built program...\n");
+    free(tmp_path);
+    free(binary);
+}
+
+void cl_print_build_log(cl_env_t** env, cl_program program)
+{
+    size_t ret_build_log_size = 0;
+    char* build_log = NULL;
 
     CL_RET = clGetProgramBuildInfo(program,
                                    (*env)->device_id,
@@ -161,16 +736,6 @@ cl_program* cl_create_program(cl_env_t** env, const char* _source)
     if (ret_build_log_size > 1)
         fprintf(stderr, "program build log:\n%s\n", build_log);
     free(build_log);
-
-    (*env)->program_count++;
-    (*env)->programs = (cl_program*)realloc(
-        (*env)->programs, (*env)->program_count * sizeof(cl_program));
-
-    (*env)->programs[(*env)->program_count - 1] = program;
-
-    printf("created cl program, count is now %d\n", (*env)->program_count);
-
-    return &((*env)->programs[(*env)->program_count - 1]);
 }
 
 cl_xpair_t* cl_create_kernel(cl_env_t** env,
@@ -185,23 +750,24 @@ cl_xpair_t* cl_create_kernel(cl_env_t** env,
 
     printf("created kernel...\n");
 
-    cl_xpair_t execution_pair;
-    execution_pair.program = *program;
-    execution_pair.kernel = kernel;
+    cl_xpair_t* execution_pair = (cl_xpair_t*)malloc(sizeof(cl_xpair_t));
+    execution_pair->program = *program;
+    execution_pair->kernel = kernel;
+    execution_pair->name = strdup(_name);
 
-    execution_pair.kernel_arg_count = 0;
-    execution_pair.kernel_arg_prim_count = 0;
-    execution_pair.kernel_arg_mem_obj_count = 0;
-    execution_pair.kernel_arg_mem_objs = NULL;
+    execution_pair->kernel_arg_count = 0;
+    execution_pair->kernel_arg_prim_count = 0;
+    execution_pair->kernel_arg_mem_obj_count = 0;
+    execution_pair->kernel_arg_mem_objs = NULL;
 
     (*env)->xpair_count++;
-    (*env)->xpairs = (cl_xpair_t*)realloc(
-        (*env)->xpairs, (*env)->xpair_count * sizeof(cl_xpair_t));
+    (*env)->xpairs = (cl_xpair_t**)realloc(
+        (*env)->xpairs, (*env)->xpair_count * sizeof(cl_xpair_t*));
     (*env)->xpairs[(*env)->xpair_count - 1] = execution_pair;
 
     printf("created execution pair, count is now %d\n", (*env)->xpair_count);
 
-    return &((*env)->xpairs[(*env)->xpair_count - 1]);
+    return execution_pair;
 }
 
 cl_xpair_t* cl_add_kernel_arg_mem_obj(cl_env_t** env,
@@ -213,6 +779,11 @@ cl_xpair_t* cl_add_kernel_arg_mem_obj(cl_env_t** env,
     assert(*env != NULL);
     assert(execution_pair != NULL);
 
+    // Every execution pair holds its own reference, so one buffer can be
+    // bound to several kernels and is released once per binding.
+    CL_RET = clRetainMemObject(mem_obj);
+    CL_CHECK_ERR(CL_RET);
+
     execution_pair->kernel_arg_count++;
     execution_pair->kernel_arg_mem_obj_count++;
     execution_pair->kernel_arg_mem_objs = (cl_mem*)realloc(
@@ -257,6 +828,81 @@ cl_xpair_t* cl_add_kernel_arg_prim(cl_env_t** env,
     return execution_pair;
 }
 
+// Reserves size bytes of local memory per work-group for a __local pointer
+// argument.
+cl_xpair_t* cl_add_kernel_arg_local(cl_env_t** env,
+                                    cl_xpair_t* execution_pair,
+                                    cl_uint position,
+                                    size_t size)
+{
+    assert(*env != NULL);
+    assert(execution_pair != NULL);
+
+    CL_RET = clSetKernelArg(execution_pair->kernel, position, size, NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    execution_pair->kernel_arg_count++;
+
+    printf("set local kernel arg, count is now %d\n",
+           execution_pair->kernel_arg_count);
+
+    return execution_pair;
+}
+
+// Returns the preferred work-group size multiple of the kernel, which is the
+// SIMD width on most devices.
+size_t cl_kernel_size_multiple(cl_env_t** env, cl_xpair_t* execution_pair)
+{
+    assert(*env != NULL);
+    assert(execution_pair != NULL);
+
+    size_t multiple = 1;
+    CL_RET = clGetKernelWorkGroupInfo(
+        execution_pair->kernel,
+        (*env)->device_id,
+        CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+        sizeof(size_t),
+        &multiple,
+        NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    return multiple > 0 ? multiple : 1;
+}
+
+// Returns the largest work-group size the kernel can run with on this device,
+// rounded down to a multiple of the preferred size. Kernel arguments have to
+// be set first, since local memory arguments can lower the limit.
+size_t cl_kernel_local_size(cl_env_t** env, cl_xpair_t* execution_pair)
+{
+    assert(*env != NULL);
+    assert(execution_pair != NULL);
+
+    size_t max_size = 1;
+    CL_RET = clGetKernelWorkGroupInfo(execution_pair->kernel,
+                                      (*env)->device_id,
+                                      CL_KERNEL_WORK_GROUP_SIZE,
+                                      sizeof(size_t),
+                                      &max_size,
+                                      NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    size_t multiple = cl_kernel_size_multiple(env, execution_pair);
+
+    if (max_size == 0) max_size = 1;
+    if (multiple > max_size) multiple = 1;
+
+    return max_size / multiple * multiple;
+}
+
+// Rounds work_items up to whole work-groups. Kernels have to skip the work
+// items past the end.
+size_t cl_global_size(size_t work_items, size_t local_size)
+{
+    assert(local_size > 0);
+
+    return (work_items + local_size - 1) / local_size * local_size;
+}
+
 cl_xpair_t* cl_enqueue_kernel(cl_env_t** env,
                               cl_xpair_t* execution_pair,
                               cl_uint work_dimensions,
@@ -267,38 +913,77 @@ cl_xpair_t* cl_enqueue_kernel(cl_env_t** env,
     assert(*env != NULL);
     assert(execution_pair != NULL);
     assert(_global_work_size != NULL);
-    assert(_local_work_size != NULL);
 
     printf("enqueuing kernel with %d arguments\n",
            execution_pair->kernel_arg_count);
 
-    CL_RET = clEnqueueNDRangeKernel((*env)->command_queue,
-                                    execution_pair->kernel,
-                                    work_dimensions,
-                                    NULL,
-                                    _global_work_size,
-                                    _local_work_size,
-                                    0,
-                                    NULL,
-                                    event);
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event profile_event = NULL;
+
+    CL_RET = clEnqueueNDRangeKernel(
+        (*env)->command_queue,
+        execution_pair->kernel,
+        work_dimensions,
+        NULL,
+        _global_work_size,
+        _local_work_size,
+        0,
+        NULL,
+        event != NULL ? event : (profile ? &profile_event : NULL));
 
     CL_CHECK_ERR(CL_RET);
 
-    if (event != NULL)
+    if (profile && CL_RET == CL_SUCCESS)
     {
-        CL_RET = clWaitForEvents(1, event);
-        CL_CHECK_ERR(CL_RET);
+        // The caller keeps its own reference to a returned event, the
+        // pending list releases the retained one when it is flushed.
+        if (event != NULL)
+        {
+            profile_event = *event;
+            clRetainEvent(profile_event);
+        }
+        int p = cl_profile_find(env, execution_pair->name, false);
+        cl_profile_add(env, p, profile_event);
     }
 
     return execution_pair;
 }
 
+// Waits for a command and returns the device time between its start and end
+// in nanoseconds, and releases its event. The queue is created with profiling
+// enabled.
+cl_ulong cl_event_elapsed(cl_event* event)
+{
+    assert(event != NULL);
+
+    CL_RET = clWaitForEvents(1, event);
+    CL_CHECK_ERR(CL_RET);
+
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+
+    CL_RET = clGetEventProfilingInfo(
+        *event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    CL_CHECK_ERR(CL_RET);
+    CL_RET = clGetEventProfilingInfo(
+        *event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    CL_RET = clReleaseEvent(*event);
+    CL_CHECK_ERR(CL_RET);
+
+    return end > start ? end - start : 0;
+}
+
 void* cl_read_buffer(cl_env_t** env,
                      cl_mem* source_mem_obj,
                      cl_bool blocking_read,
                      size_t size,
                      void* ptr)
 {
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event event = NULL;
+
     CL_RET = clEnqueueReadBuffer((*env)->command_queue,
                                  *source_mem_obj,
                                  blocking_read,
@@ -307,12 +992,364 @@ void* cl_read_buffer(cl_env_t** env,
                                  ptr,
                                  0,
                                  NULL,
-                                 NULL);
+                                 profile ? &event : NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    if (profile && CL_RET == CL_SUCCESS)
+    {
+        int p = cl_profile_transfer(env, "read", *source_mem_obj);
+        (*env)->profiles[p].bytes += size;
+        cl_profile_add(env, p, event);
+    }
+
+    return ptr;
+}
+
+void cl_write_buffer(cl_env_t** env,
+                     cl_mem* target_mem_obj,
+                     cl_bool blocking_write,
+                     size_t size,
+                     const void* _ptr)
+{
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event event = NULL;
+
+    CL_RET = clEnqueueWriteBuffer((*env)->command_queue,
+                                  *target_mem_obj,
+                                  blocking_write,
+                                  0,
+                                  size,
+                                  _ptr,
+                                  0,
+                                  NULL,
+                                  profile ? &event : NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    if (profile && CL_RET == CL_SUCCESS)
+    {
+        int p = cl_profile_transfer(env, "write", *target_mem_obj);
+        (*env)->profiles[p].bytes += size;
+        cl_profile_add(env, p, event);
+    }
+}
+
+void cl_fill_buffer(cl_env_t** env,
+                    cl_mem* mem_obj,
+                    const void* _pattern,
+                    size_t pattern_size,
+                    size_t size)
+{
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event event = NULL;
+
+    CL_RET = clEnqueueFillBuffer((*env)->command_queue,
+                                 *mem_obj,
+                                 _pattern,
+                                 pattern_size,
+                                 0,
+                                 size,
+                                 0,
+                                 NULL,
+                                 profile ? &event : NULL);
     CL_CHECK_ERR(CL_RET);
 
+    if (profile && CL_RET == CL_SUCCESS)
+    {
+        int p = cl_profile_transfer(env, "fill", *mem_obj);
+        (*env)->profiles[p].bytes += size;
+        cl_profile_add(env, p, event);
+    }
+}
+
+// Maps the start of a buffer for the host with a blocking map. On buffers
+// created with CL_MEM_USE_HOST_PTR this returns the host pointer itself,
+// and only synchronizes caches on devices that share memory with the host.
+void* cl_map_buffer(cl_env_t** env,
+                    cl_mem* mem_obj,
+                    cl_map_flags map_flags,
+                    size_t size)
+{
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event event = NULL;
+
+    void* ptr = clEnqueueMapBuffer((*env)->command_queue,
+                                   *mem_obj,
+                                   CL_TRUE,
+                                   map_flags,
+                                   0,
+                                   size,
+                                   0,
+                                   NULL,
+                                   profile ? &event : NULL,
+                                   &CL_RET);
+    CL_CHECK_ERR(CL_RET);
+
+    if (profile && CL_RET == CL_SUCCESS)
+    {
+        int p = cl_profile_transfer(env, "map", *mem_obj);
+        (*env)->profiles[p].bytes += size;
+        cl_profile_add(env, p, event);
+    }
+
     return ptr;
 }
 
+void cl_unmap_buffer(cl_env_t** env, cl_mem* mem_obj, void* ptr)
+{
+    const bool profile = (*env)->profile_format != CL_PROFILE_OFF;
+    cl_event event = NULL;
+
+    CL_RET = clEnqueueUnmapMemObject((*env)->command_queue,
+                                     *mem_obj,
+                                     ptr,
+                                     0,
+                                     NULL,
+                                     profile ? &event : NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    if (profile && CL_RET == CL_SUCCESS)
+    {
+        cl_profile_add(env, cl_profile_transfer(env, "unmap", *mem_obj), event);
+    }
+}
+
+// Allocates host memory for CL_MEM_USE_HOST_PTR buffers, release it with
+// free.
+void* cl_host_alloc(size_t size)
+{
+    size_t pages = (size + CL_HOST_ALIGN - 1) / CL_HOST_ALIGN;
+    if (pages == 0) pages = 1;
+
+    void* ptr = aligned_alloc(CL_HOST_ALIGN, pages * CL_HOST_ALIGN);
+    assert(ptr != NULL);
+
+    return ptr;
+}
+
+bool cl_host_aligned(const void* _ptr)
+{
+    return (uintptr_t)_ptr % CL_HOST_ALIGN == 0;
+}
+
+// Looks the extension up in the space separated list the device reports.
+bool cl_device_extension(cl_env_t** env, const char* _name)
+{
+    size_t size = 0;
+    CL_RET = clGetDeviceInfo(
+        (*env)->device_id, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+    CL_CHECK_ERR(CL_RET);
+
+    char* extensions = (char*)malloc(size + 1);
+    CL_RET = clGetDeviceInfo(
+        (*env)->device_id, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+    CL_CHECK_ERR(CL_RET);
+    extensions[size] = '\0';
+
+    bool found = false;
+    size_t len = strlen(_name);
+    for (char* p = strstr(extensions, _name); p != NULL && !found;
+         p = strstr(p + 1, _name))
+    {
+        found = (p == extensions || p[-1] == ' ') &&
+                (p[len] == ' ' || p[len] == '\0');
+    }
+
+    free(extensions);
+
+    return found;
+}
+
+// Names the buffer in the profile of its transfers.
+void cl_label_mem_obj(cl_env_t** env, cl_mem mem_obj, const char* _label)
+{
+    assert(*env != NULL);
+    assert(_label != NULL);
+
+    (*env)->mem_label_count++;
+    (*env)->mem_label_objs = (cl_mem*)realloc(
+        (*env)->mem_label_objs, (*env)->mem_label_count * sizeof(cl_mem));
+    (*env)->mem_labels = (char**)realloc(
+        (*env)->mem_labels, (*env)->mem_label_count * sizeof(char*));
+
+    (*env)->mem_label_objs[(*env)->mem_label_count - 1] = mem_obj;
+    (*env)->mem_labels[(*env)->mem_label_count - 1] = strdup(_label);
+}
+
+// Returns the index of the profile with this name, adding it if needed.
+int cl_profile_find(cl_env_t** env, const char* _name, bool transfer)
+{
+    for (int i = 0; i < (*env)->profile_count; i++)
+    {
+        if ((*env)->profiles[i].transfer == transfer &&
+            strncmp((*env)->profiles[i].name, _name, 63) == 0)
+            return i;
+    }
+
+    (*env)->profile_count++;
+    (*env)->profiles = (cl_profile_t*)realloc(
+        (*env)->profiles, (*env)->profile_count * sizeof(cl_profile_t));
+
+    cl_profile_t* profile = &(*env)->profiles[(*env)->profile_count - 1];
+    memset(profile, 0, sizeof(cl_profile_t));
+    snprintf(profile->name, sizeof(profile->name), "%s", _name);
+    profile->transfer = transfer;
+
+    return (*env)->profile_count - 1;
+}
+
+// Returns the profile of this kind of transfer on the buffer. Buffers are
+// named by cl_label_mem_obj, later labels win when a buffer is reused.
+int cl_profile_transfer(cl_env_t** env, const char* _kind, cl_mem mem_obj)
+{
+    const char* label = "buffer";
+    for (int i = (*env)->mem_label_count - 1; i >= 0; i--)
+    {
+        if ((*env)->mem_label_objs[i] == mem_obj)
+        {
+            label = (*env)->mem_labels[i];
+            break;
+        }
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s", _kind, label);
+
+    return cl_profile_find(env, name, true);
+}
+
+// Adds the timings of a finished command to a profile.
+void cl_profile_record(cl_env_t** env, int profile, cl_event event)
+{
+    cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+
+    clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+    clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL);
+    clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    CL_RET = clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    CL_CHECK_ERR(CL_RET);
+
+    cl_profile_t* p = &(*env)->profiles[profile];
+    p->calls++;
+    if (submit > queued) p->queued += submit - queued;
+    if (start > submit) p->submit += start - submit;
+    if (end > start) p->run += end - start;
+}
+
+// Takes ownership of the event of a command that may not have finished, and
+// records it once it has. Waits for the pending commands when there are too
+// many, so long runs stay bounded in memory.
+void cl_profile_add(cl_env_t** env, int profile, cl_event event)
+{
+    if ((*env)->pending_count == CL_PROFILE_PENDING_MAX)
+    {
+        cl_profile_flush(env);
+    }
+
+    (*env)->pending_events[(*env)->pending_count] = event;
+    (*env)->pending_profiles[(*env)->pending_count] = profile;
+    (*env)->pending_count++;
+}
+
+void cl_profile_flush(cl_env_t** env)
+{
+    if ((*env)->pending_count == 0) return;
+
+    CL_RET = clWaitForEvents((*env)->pending_count, (*env)->pending_events);
+    CL_CHECK_ERR(CL_RET);
+
+    for (int i = 0; i < (*env)->pending_count; i++)
+    {
+        cl_profile_record(
+            env, (*env)->pending_profiles[i], (*env)->pending_events[i]);
+        clReleaseEvent((*env)->pending_events[i]);
+    }
+
+    (*env)->pending_count = 0;
+}
+
+// Prints the profile totals to stderr, kernels first and transfers second,
+// as a table or as JSON.
+void cl_profile_report(cl_env_t** env)
+{
+    assert(*env != NULL);
+
+    if ((*env)->profile_format == CL_PROFILE_OFF) return;
+
+    cl_profile_flush(env);
+
+    const bool json = (*env)->profile_format == CL_PROFILE_JSON;
+    cl_ulong totals[2] = {0, 0};
+
+    if (json)
+        fprintf(stderr, "{\n");
+    else
+        fprintf(stderr,
+                "%-28s %8s %12s %12s %12s %12s\n",
+                "name",
+                "calls",
+                "queued_ms",
+                "submit_ms",
+                "run_ms",
+                "bytes");
+
+    for (int transfer = 0; transfer < 2; transfer++)
+    {
+        if (json)
+            fprintf(
+                stderr, "  \"%s\": [", transfer ? "transfers" : "kernels");
+
+        bool first = true;
+        for (int i = 0; i < (*env)->profile_count; i++)
+        {
+            cl_profile_t* p = &(*env)->profiles[i];
+            if (p->transfer != (bool)transfer) continue;
+
+            totals[transfer] += p->run;
+
+            if (json)
+                fprintf(stderr,
+                        "%s\n    {\"name\": \"%s\", \"calls\": %d, "
+                        "\"queued_ms\": %.3f, \"submit_ms\": %.3f, "
+                        "\"run_ms\": %.3f, \"bytes\": %llu}",
+                        first ? "" : ",",
+                        p->name,
+                        p->calls,
+                        p->queued / 1e6,
+                        p->submit / 1e6,
+                        p->run / 1e6,
+                        (unsigned long long)p->bytes);
+            else
+                fprintf(stderr,
+                        "%-28s %8d %12.3f %12.3f %12.3f %12llu\n",
+                        p->name,
+                        p->calls,
+                        p->queued / 1e6,
+                        p->submit / 1e6,
+                        p->run / 1e6,
+                        (unsigned long long)p->bytes);
+
+            first = false;
+        }
+
+        if (json) fprintf(stderr, "%s],\n", first ? "" : "\n  ");
+    }
+
+    if (json)
+        fprintf(stderr,
+                "  \"kernel_run_ms\": %.3f,\n  \"transfer_run_ms\": %.3f\n}\n",
+                totals[0] / 1e6,
+                totals[1] / 1e6);
+    else
+        fprintf(stderr,
+                "kernels ran for %.3fms, transfers for %.3fms\n",
+                totals[0] / 1e6,
+                totals[1] / 1e6);
+}
+
 void cl_free(cl_env_t** env)
 {
     assert(*env != NULL);
@@ -324,7 +1361,7 @@ void cl_free(cl_env_t** env)
 
     for (int i = 0; i < (*env)->xpair_count; i++)
     {
-        cl_xpair_t* xpair = &(*env)->xpairs[i];
+        cl_xpair_t* xpair = (*env)->xpairs[i];
         for (int j = 0; j < xpair->kernel_arg_mem_obj_count; j++)
         {
             CL_RET = clReleaseMemObject(xpair->kernel_arg_mem_objs[j]);
@@ -332,6 +1369,9 @@ void cl_free(cl_env_t** env)
         }
         CL_RET = clReleaseKernel(xpair->kernel);
         CL_CHECK_ERR(CL_RET);
+        free(xpair->kernel_arg_mem_objs);
+        free(xpair->name);
+        free(xpair);
     }
 
     if ((*env)->xpair_count > 0) free((*env)->xpairs);
@@ -342,7 +1382,25 @@ void cl_free(cl_env_t** env)
         CL_CHECK_ERR(CL_RET);
     }
 
-    if ((*env)->program_count > 0) free((*env)->programs);
+    if ((*env)->program_count > 0)
+    {
+        free((*env)->programs);
+        free((*env)->program_keys);
+    }
+
+    for (int i = 0; i < (*env)->pending_count; i++)
+    {
+        clReleaseEvent((*env)->pending_events[i]);
+    }
+
+    for (int i = 0; i < (*env)->mem_label_count; i++)
+    {
+        free((*env)->mem_labels[i]);
+    }
+
+    free((*env)->mem_labels);
+    free((*env)->mem_label_objs);
+    free((*env)->profiles);
 
     CL_RET = clReleaseCommandQueue((*env)->command_queue);
     CL_CHECK_ERR(CL_RET);
@@ -451,3 +1509,52 @@ const char* cl_error_string(cl_int err)
         return "Unknown error";
     }
 }
+
+// Returns 0, which is no device type, for unknown names.
+cl_device_type cl_device_type_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "cpu") == 0) return CL_DEVICE_TYPE_CPU;
+    if (strcmp(_name, "gpu") == 0) return CL_DEVICE_TYPE_GPU;
+    if (strcmp(_name, "accelerator") == 0) return CL_DEVICE_TYPE_ACCELERATOR;
+    if (strcmp(_name, "all") == 0) return CL_DEVICE_TYPE_ALL;
+
+    return 0;
+}
+
+// Devices may report the default bit alongside their actual type.
+const char* cl_device_type_name(cl_device_type device_type)
+{
+    if (device_type == CL_DEVICE_TYPE_ALL) return "all";
+    if (device_type & CL_DEVICE_TYPE_GPU) return "gpu";
+    if (device_type & CL_DEVICE_TYPE_CPU) return "cpu";
+    if (device_type & CL_DEVICE_TYPE_ACCELERATOR) return "accelerator";
+
+    return "unknown";
+}
+
+// Returns -1 for an unknown format.
+int cl_profile_format_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "off") == 0) return CL_PROFILE_OFF;
+    if (strcmp(_name, "table") == 0) return CL_PROFILE_TABLE;
+    if (strcmp(_name, "json") == 0) return CL_PROFILE_JSON;
+
+    return -1;
+}
+
+const char* cl_profile_format_name(cl_profile_format_t format)
+{
+    switch (format)
+    {
+    case CL_PROFILE_TABLE:
+        return "table";
+    case CL_PROFILE_JSON:
+        return "json";
+    default:
+        return "off";
+    }
+}
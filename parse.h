@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "kmeans.h"
+
 #define HELP \
     "USAGE:\n\
     compress [FLAGS] [OPTIONS]\n\
@@ -17,18 +19,86 @@ FLAGS:\n\
         Use the GPU.\n\
     -x\n\
         No stdout.\n\
+    --autotune\n\
+        With -g, times the OpenCL pixel kernels over a range of work-group\n\
+        sizes and pixels per work-item before clustering, and saves the\n\
+        fastest for this device and k in the cache directory. Later runs\n\
+        on the same device and k use them.\n\
+    --cl-list\n\
+        Lists the OpenCL platforms and their devices of the --cl-type type,\n\
+        with the indices --cl-platform and --cl-device take, and exits.\n\
 \n\
 OPTIONS:\n\
+    -a<ALGO>\n\
+        Sets the clustering algorithm [lloyd, elkan, hamerly]. Elkan and\n\
+        hamerly give the same result as lloyd, but skip most distance\n\
+        computations using triangle inequality bounds. Elkan keeps k+2\n\
+        floats per pixel, hamerly keeps 2. -g runs lloyd. Default: lloyd.\n\
     -i<IN_PATH>\n\
         Sets the input image path. Default: in.png.\n\
+    --raw=<W>x<H>[x<C>]\n\
+        Reads -i as bare pixels, C in [1..4]. Default: 3.\n\
     -o<OUT_PATH>\n\
         Sets the output image path. Default: out.png.\n\
+    --out=<FORMAT>\n\
+        Sets the output pixel format [rgba, rgb, index]. Index writes an\n\
+        indexed-color PNG with the centroids as its palette, which is much\n\
+        smaller and faster to encode. With -g the output image is written\n\
+        on the device. Default: rgba.\n\
+    --png-level=<LEVEL>\n\
+        Sets the PNG compression level [0..9], 0 stores. Default: 6.\n\
     -k<N_CENTROIDS>\n\
         Sets the number of centroids [2..256]. Default: 10.\n\
+    -m<MODE>\n\
+        Sets what is clustered [pixel, hist, cube5, cube6]. Hist runs\n\
+        weighted lloyd iterations over a table of the distinct colors and\n\
+        their pixel counts, so iteration cost does not depend on\n\
+        resolution. The result is the same as lloyd over pixels. Cube5 and\n\
+        cube6 instead bin pixels into a 32^3 or 64^3 color cube, which\n\
+        bounds iteration cost by a constant at some loss of precision.\n\
+        Pixels are then mapped to the nearest centroid at full precision.\n\
+        -g only clusters pixels. Default: pixel.\n\
     -n<N_ITER>\n\
-        Sets the iteration count [1..128]. Default: 16.\n\
+        Sets the maximum iteration count [1..128]. Default: 16.\n\
     -t<N_THREADS>\n\
-        Sets the thread count [1..64]. Default: 1.\n"
+        Sets the thread count [1..64]. Default: 1.\n\
+    --tol=<TOL>\n\
+        Stops clustering once no centroid moved more than TOL in an\n\
+        iteration. Negative disables. Default: 0.\n\
+    --min-changed=<FRAC>\n\
+        Stops clustering once at most FRAC [0..1] of the pixels changed\n\
+        cluster in an iteration. Negative disables. Default: 0.\n\
+    --isa=<ISA>\n\
+        Forces the cpu kernel variant [auto, scalar, sse4.2, avx2, avx512].\n\
+        Auto picks the widest one the cpu supports. Default: auto.\n\
+    --schedule=<KIND>\n\
+        Sets the OpenMP schedule of the multithreaded lloyd pixel loop\n\
+        [static, dynamic, guided, auto]. Default: static.\n\
+    --chunk=<N_BLOCKS>\n\
+        Sets the schedule chunk size, in blocks of 1024 pixels. 0 uses the\n\
+        schedule default, which for static is one contiguous range per\n\
+        thread. Default: 0.\n\
+    --cl-source=<PATH>\n\
+        Builds the OpenCL kernels from the source file at PATH instead of\n\
+        the ones embedded at build time. Default: embedded.\n\
+    --cl-type=<TYPE>\n\
+        Sets the OpenCL device type to run on [cpu, gpu, accelerator,\n\
+        all]. Default: gpu.\n\
+    --cl-platform=<INDEX>\n\
+        Sets the OpenCL platform to run on. Default: the first platform\n\
+        with a device of the --cl-type type.\n\
+    --cl-device=<INDEX>\n\
+        Sets which device of the --cl-type type on the platform to run\n\
+        on. Default: 0.\n\
+    --cl-profile=<FORMAT>\n\
+        Times every OpenCL kernel run and buffer transfer, and prints the\n\
+        totals per kernel and per buffer to stderr at exit [off, table,\n\
+        json]. Default: off.\n\
+    --cl-zero-copy=<MODE>\n\
+        Sets whether the OpenCL device works on the image and the labels in\n\
+        host memory instead of copies [auto, on, off]. Auto turns it on for\n\
+        cpu devices and gpus that share memory with the host. Default:\n\
+        auto.\n"
 
 static int REQUIRED_ARGC = 1;
 static char* DEFAULT_IMG_PATH_IN = "in.png";
@@ -38,9 +108,31 @@ typedef struct args_t
 {
     char* img_path_in;
     char* img_path_out;
+    // Raw input is read when raw_width is set.
+    int raw_width;
+    int raw_height;
+    int raw_comp;
     int cluster_count;
     int iter_count;
     int thread_count;
+    double tol;
+    double min_changed;
+    kmean_algo_t algo;
+    kmean_mode_t mode;
+    kmean_out_t out;
+    int png_level;
+    simd_isa_t isa;
+    omp_sched_t schedule;
+    int chunk;
+    char* cl_source_path;
+    int cl_platform;
+    int cl_device;
+    cl_device_type cl_type;
+    cl_profile_format_t cl_profile;
+    // -1 leaves zero-copy up to the device, 0 and 1 force it off or on.
+    int cl_zero_copy;
+    bool cl_list;
+    bool autotune;
     bool use_gpu;
     bool no_stdout;
 } args_t;
@@ -68,9 +160,29 @@ args_t* args_init(args_t** args)
     memset((*args)->img_path_out, 0, len + 1);
     strcpy((*args)->img_path_out, DEFAULT_IMG_PATH_OUT);
 
+    (*args)->raw_width = 0;
+    (*args)->raw_height = 0;
+    (*args)->raw_comp = 3;
     (*args)->cluster_count = 10;
     (*args)->iter_count = 16;
     (*args)->thread_count = 1;
+    (*args)->tol = 0.0;
+    (*args)->min_changed = 0.0;
+    (*args)->algo = KMEANS_ALGO_LLOYD;
+    (*args)->mode = KMEANS_MODE_PIXEL;
+    (*args)->out = KMEANS_OUT_RGBA;
+    (*args)->png_level = PNG_DEFAULT_LEVEL;
+    (*args)->isa = SIMD_ISA_AUTO;
+    (*args)->schedule = omp_sched_static;
+    (*args)->chunk = 0;
+    (*args)->cl_source_path = NULL;
+    (*args)->cl_platform = -1;
+    (*args)->cl_device = 0;
+    (*args)->cl_type = CL_DEVICE_TYPE_GPU;
+    (*args)->cl_profile = CL_PROFILE_OFF;
+    (*args)->cl_zero_copy = -1;
+    (*args)->cl_list = false;
+    (*args)->autotune = false;
     (*args)->use_gpu = false;
     (*args)->no_stdout = false;
 
@@ -90,11 +202,227 @@ args_t* args_parse(args_t** args, int argc, const char** argv)
         exit(0);
     }
 
-    const char* arg_names[] = {"-i", "-k", "-n", "-o", "-t", "-g", "-x"};
+    const char* arg_names[] = {
+        "-i", "-k", "-n", "-o", "-t", "-g", "-x", "-a", "-m"};
+    const char* long_arg_names[] = {
+        "--tol=",
+        "--min-changed=",
+        "--isa=",
+        "--schedule=",
+        "--chunk=",
+        "--cl-source=",
+        "--cl-type=",
+        "--cl-platform=",
+        "--cl-device=",
+        "--cl-list",
+        "--autotune",
+        "--cl-profile=",
+        "--cl-zero-copy=",
+        "--out=",
+        "--png-level=",
+        "--raw="};
 
     for (int i = 1; i < argc; i++)
     {
-        if (strncmp(argv[i], arg_names[0], 2) == 0)
+        if (strncmp(argv[i], long_arg_names[0], 6) == 0)
+        {
+            (*args)->tol = atof(argv[i] + 6);
+        }
+        else if (strncmp(argv[i], long_arg_names[1], 14) == 0)
+        {
+            double val = atof(argv[i] + 14);
+            if (val > 1.0)
+            {
+                fprintf(stderr,
+                        "invalid changed fraction: %f, should be at most 1\n",
+                        val);
+            }
+            else
+            {
+                (*args)->min_changed = val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[2], 6) == 0)
+        {
+            int val = simd_isa_parse(argv[i] + 6);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid isa: %s, should be auto, scalar, sse4.2, avx2 "
+                        "or avx512\n",
+                        argv[i] + 6);
+            }
+            else
+            {
+                (*args)->isa = (simd_isa_t)val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[3], 11) == 0)
+        {
+            int val = kmeans_schedule_parse(argv[i] + 11);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid schedule: %s, should be static, dynamic, "
+                        "guided or auto\n",
+                        argv[i] + 11);
+            }
+            else
+            {
+                (*args)->schedule = (omp_sched_t)val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[4], 8) == 0)
+        {
+            int val = atoi(argv[i] + 8);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid chunk size: %d, should be at least 0\n",
+                        val);
+            }
+            else
+            {
+                (*args)->chunk = val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[5], 12) == 0)
+        {
+            size_t len = strlen(argv[i] + 12);
+            (*args)->cl_source_path =
+                (char*)realloc((*args)->cl_source_path, len + 1);
+            memset((*args)->cl_source_path, 0, len + 1);
+            strcpy((*args)->cl_source_path, argv[i] + 12);
+        }
+        else if (strncmp(argv[i], long_arg_names[6], 10) == 0)
+        {
+            cl_device_type val = cl_device_type_parse(argv[i] + 10);
+            if (val == 0)
+            {
+                fprintf(stderr,
+                        "invalid device type: %s, should be cpu, gpu, "
+                        "accelerator or all\n",
+                        argv[i] + 10);
+            }
+            else
+            {
+                (*args)->cl_type = val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[7], 14) == 0)
+        {
+            int val = atoi(argv[i] + 14);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid platform index: %d, should be at least 0\n",
+                        val);
+            }
+            else
+            {
+                (*args)->cl_platform = val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[8], 12) == 0)
+        {
+            int val = atoi(argv[i] + 12);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid device index: %d, should be at least 0\n",
+                        val);
+            }
+            else
+            {
+                (*args)->cl_device = val;
+            }
+        }
+        else if (strcmp(argv[i], long_arg_names[9]) == 0)
+        {
+            (*args)->cl_list = true;
+        }
+        else if (strcmp(argv[i], long_arg_names[10]) == 0)
+        {
+            (*args)->autotune = true;
+        }
+        else if (strncmp(argv[i], long_arg_names[11], 13) == 0)
+        {
+            int val = cl_profile_format_parse(argv[i] + 13);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid profile format: %s, should be off, table or "
+                        "json\n",
+                        argv[i] + 13);
+            }
+            else
+            {
+                (*args)->cl_profile = (cl_profile_format_t)val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[12], 15) == 0)
+        {
+            const char* val = argv[i] + 15;
+            if (strcmp(val, "auto") == 0)
+                (*args)->cl_zero_copy = -1;
+            else if (strcmp(val, "off") == 0)
+                (*args)->cl_zero_copy = 0;
+            else if (strcmp(val, "on") == 0)
+                (*args)->cl_zero_copy = 1;
+            else
+                fprintf(stderr,
+                        "invalid zero-copy mode: %s, should be auto, on or "
+                        "off\n",
+                        val);
+        }
+        else if (strncmp(argv[i], long_arg_names[13], 6) == 0)
+        {
+            int val = kmeans_out_parse(argv[i] + 6);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid output format: %s, should be rgba, rgb or "
+                        "index\n",
+                        argv[i] + 6);
+            }
+            else
+            {
+                (*args)->out = (kmean_out_t)val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[14], 12) == 0)
+        {
+            int val = atoi(argv[i] + 12);
+            if (val < 0 || val > 9)
+            {
+                fprintf(stderr,
+                        "invalid png level: %d, should be between 0 and 9\n",
+                        val);
+            }
+            else
+            {
+                (*args)->png_level = val;
+            }
+        }
+        else if (strncmp(argv[i], long_arg_names[15], 6) == 0)
+        {
+            int width = 0, height = 0, comp = 3;
+            int count = sscanf(argv[i] + 6, "%dx%dx%d", &width, &height, &comp);
+            if (count < 2 || width <= 0 || height <= 0 || comp < 1 || comp > 4)
+            {
+                fprintf(stderr,
+                        "invalid raw size: %s, should be <W>x<H>[x<C>] with C "
+                        "between 1 and 4\n",
+                        argv[i] + 6);
+            }
+            else
+            {
+                (*args)->raw_width = width;
+                (*args)->raw_height = height;
+                (*args)->raw_comp = comp;
+            }
+        }
+        else if (strncmp(argv[i], arg_names[0], 2) == 0)
         {
             size_t len = strlen(argv[i] + 2);
             (*args)->img_path_in =
@@ -105,12 +433,13 @@ args_t* args_parse(args_t** args, int argc, const char** argv)
         else if (strncmp(argv[i], arg_names[1], 2) == 0)
         {
             int val = atoi(argv[i] + 2);
-            if (val < 2 || val > 256)
+            if (val < 2 || val > SIMD_MAX_K)
             {
-                fprintf(
-                    stderr,
-                    "invalid cluster count: %d, should be between 2 and 256\n",
-                    val);
+                fprintf(stderr,
+                        "invalid cluster count: %d, should be between 2 and "
+                        "%d\n",
+                        val,
+                        SIMD_MAX_K);
             }
             else
             {
@@ -163,20 +492,92 @@ args_t* args_parse(args_t** args, int argc, const char** argv)
         {
             (*args)->no_stdout = true;
         }
+        else if (strncmp(argv[i], arg_names[7], 2) == 0)
+        {
+            int val = kmeans_algo_parse(argv[i] + 2);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid algorithm: %s, should be lloyd, elkan or "
+                        "hamerly\n",
+                        argv[i] + 2);
+            }
+            else
+            {
+                (*args)->algo = (kmean_algo_t)val;
+            }
+        }
+        else if (strncmp(argv[i], arg_names[8], 2) == 0)
+        {
+            int val = kmeans_mode_parse(argv[i] + 2);
+            if (val < 0)
+            {
+                fprintf(stderr,
+                        "invalid mode: %s, should be pixel, hist, cube5 or "
+                        "cube6\n",
+                        argv[i] + 2);
+            }
+            else
+            {
+                (*args)->mode = (kmean_mode_t)val;
+            }
+        }
         else
         {
             fprintf(stderr, "unknown argument at position: %d\n", i);
         }
     }
 
+    // The OpenCL kernels only run lloyd over pixels.
+    if ((*args)->use_gpu && (*args)->mode != KMEANS_MODE_PIXEL)
+    {
+        fprintf(stderr,
+                "mode %s is not supported with -g, using pixel\n",
+                kmeans_mode_name((*args)->mode));
+        (*args)->mode = KMEANS_MODE_PIXEL;
+    }
+    if ((*args)->use_gpu && (*args)->algo != KMEANS_ALGO_LLOYD)
+    {
+        fprintf(stderr,
+                "algorithm %s is not supported with -g, using lloyd\n",
+                kmeans_algo_name((*args)->algo));
+        (*args)->algo = KMEANS_ALGO_LLOYD;
+    }
+
     printf(
         "running with arguments: "
-        "img_in=%s,img_out=%s,k=%d,iter=%d,thr=%d,gpu=%d,no_stdout=%d\n",
+        "img_in=%s,img_out=%s,raw=%dx%dx%d,k=%d,iter=%d,thr=%d,tol=%f,"
+        "min_changed=%f,"
+        "algo=%s,mode=%s,out=%s,png_level=%d,isa=%s,schedule=%s,chunk=%d,"
+        "cl_source=%s,"
+        "cl_type=%s,cl_platform=%d,cl_device=%d,cl_profile=%s,"
+        "cl_zero_copy=%s,autotune=%d,gpu=%d,no_stdout=%d\n",
         (*args)->img_path_in,
         (*args)->img_path_out,
+        (*args)->raw_width,
+        (*args)->raw_height,
+        (*args)->raw_comp,
         (*args)->cluster_count,
         (*args)->iter_count,
         (*args)->thread_count,
+        (*args)->tol,
+        (*args)->min_changed,
+        kmeans_algo_name((*args)->algo),
+        kmeans_mode_name((*args)->mode),
+        kmeans_out_name((*args)->out),
+        (*args)->png_level,
+        simd_isa_name((*args)->isa),
+        kmeans_schedule_name((*args)->schedule),
+        (*args)->chunk,
+        (*args)->cl_source_path ? (*args)->cl_source_path : "embedded",
+        cl_device_type_name((*args)->cl_type),
+        (*args)->cl_platform,
+        (*args)->cl_device,
+        cl_profile_format_name((*args)->cl_profile),
+        (*args)->cl_zero_copy < 0 ? "auto"
+        : (*args)->cl_zero_copy   ? "on"
+                                  : "off",
+        (*args)->autotune,
         (*args)->use_gpu,
         (*args)->no_stdout);
 
@@ -189,5 +590,6 @@ void args_free(args_t** args)
 
     free((*args)->img_path_in);
     free((*args)->img_path_out);
+    free((*args)->cl_source_path);
     free(*args);
 }
@@ -0,0 +1,616 @@
+#pragma once
+
+#include <assert.h>
+#include <omp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Filtered image data is deflated in chunks of this many bytes, one chunk per
+// OpenMP work item. Each chunk may still match against the window before it,
+// ends on a byte boundary with a sync flush, and is written as its own IDAT,
+// so the chunks join into one zlib stream the way pigz does it.
+#define PNG_CHUNK_SIZE (256 * 1024)
+#define PNG_WINDOW_SIZE 32768
+#define PNG_HASH_BITS 15
+#define PNG_MIN_MATCH 3
+#define PNG_MAX_MATCH 258
+#define PNG_MAX_STORED 65535
+#define PNG_ADLER_BASE 65521
+#define PNG_DEFAULT_LEVEL 6
+// Palette PNGs hold at most this many colors at 8 bits per index.
+#define PNG_MAX_PALETTE 256
+
+// Growing output buffer, with bits packed least significant first.
+typedef struct png_bits_t
+{
+    uint8_t* buf;
+    size_t size;
+    size_t cap;
+    uint64_t acc;
+    int count;
+} png_bits_t;
+
+int png_write(const char* _pathname,
+              int width,
+              int height,
+              int comp,
+              const uint8_t* _data,
+              const uint32_t* _palette,
+              int palette_size,
+              int level,
+              int threads);
+void png_filter_row(const uint8_t* _row,
+                    const uint8_t* _prev,
+                    int row_bytes,
+                    int bpp,
+                    bool adaptive,
+                    uint8_t* out);
+void png_deflate(png_bits_t* bits,
+                 const uint8_t* _data,
+                 size_t begin,
+                 size_t end,
+                 bool last,
+                 int level,
+                 int32_t* head,
+                 int32_t* prev);
+void png_bits_put(png_bits_t* bits, uint32_t value, int count);
+void png_bits_align(png_bits_t* bits);
+void png_bits_bytes(png_bits_t* bits, const uint8_t* _data, size_t size);
+uint32_t png_adler32(uint32_t adler, const uint8_t* _data, size_t size);
+uint32_t png_adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2);
+uint32_t png_crc32(uint32_t crc, const uint8_t* _data, size_t size);
+bool png_write_chunk(FILE* fp,
+                     const char* _type,
+                     const uint8_t* _data,
+                     uint32_t size);
+void png_put_u32(uint8_t* buf, uint32_t val);
+
+// Writes an 8-bit PNG of 1 to 4 channels with threads threads. With a palette
+// a single channel image holds palette indices, and the palette RGBA entries
+// in memory order, of which alpha is dropped. Level 0 stores the image
+// uncompressed, levels 1 to 9 search more and more for matches. Returns 0 on
+// failure, like stbi_write_png.
+int png_write(const char* _pathname,
+              int width,
+              int height,
+              int comp,
+              const uint8_t* _data,
+              const uint32_t* _palette,
+              int palette_size,
+              int level,
+              int threads)
+{
+    assert(_pathname != NULL);
+    assert(_data != NULL);
+    assert(comp >= 1 && comp <= 4);
+    assert(_palette == NULL || comp == 1);
+    assert(_palette == NULL ||
+           (palette_size > 0 && palette_size <= PNG_MAX_PALETTE));
+    assert(level >= 0 && level <= 9);
+    assert(threads > 0);
+
+    omp_set_num_threads(threads);
+
+    // Every row starts with its filter type. Rows only read the unfiltered
+    // row above them, so they are filtered independently. Palette indices
+    // do not predict each other, so they stay unfiltered, as the PNG spec
+    // recommends.
+    const int row_bytes = width * comp;
+    const size_t row = (size_t)row_bytes + 1;
+    const size_t size = row * height;
+    const bool adaptive = _palette == NULL && level > 0;
+    uint8_t* filtered = (uint8_t*)malloc(size);
+
+#pragma omp parallel for schedule(static) default(none)                        \
+    shared(height, row_bytes, row, comp, adaptive, _data, filtered)
+    for (int y = 0; y < height; y++)
+    {
+        png_filter_row(&_data[(size_t)y * row_bytes],
+                       y > 0 ? &_data[(size_t)(y - 1) * row_bytes] : NULL,
+                       row_bytes,
+                       comp,
+                       adaptive,
+                       &filtered[y * row]);
+    }
+
+    const int chunk_count = (int)((size + PNG_CHUNK_SIZE - 1) / PNG_CHUNK_SIZE);
+    png_bits_t* chunks = (png_bits_t*)calloc(chunk_count, sizeof(png_bits_t));
+    uint32_t* adlers = (uint32_t*)malloc(chunk_count * sizeof(uint32_t));
+
+#pragma omp parallel shared(                                                   \
+    chunk_count, size, level, filtered, chunks, adlers) default(none)
+    {
+        int32_t* head =
+            (int32_t*)malloc((1 << PNG_HASH_BITS) * sizeof(int32_t));
+        int32_t* prev = (int32_t*)malloc(PNG_WINDOW_SIZE * sizeof(int32_t));
+
+#pragma omp for schedule(dynamic)
+        for (int c = 0; c < chunk_count; c++)
+        {
+            size_t begin = (size_t)c * PNG_CHUNK_SIZE;
+            size_t end =
+                begin + PNG_CHUNK_SIZE < size ? begin + PNG_CHUNK_SIZE : size;
+
+            png_bits_t* bits = &chunks[c];
+            bits->cap = (end - begin) / 2 + 1024;
+            bits->buf = (uint8_t*)malloc(bits->cap);
+
+            // The zlib header, with the level as a hint.
+            if (c == 0)
+            {
+                static const uint8_t header[4][2] = {
+                    {0x78, 0x01}, {0x78, 0x5e}, {0x78, 0x9c}, {0x78, 0xda}};
+                int hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+                png_bits_bytes(bits, header[hint], 2);
+            }
+
+            png_deflate(bits,
+                        filtered,
+                        begin,
+                        end,
+                        c == chunk_count - 1,
+                        level,
+                        head,
+                        prev);
+            adlers[c] = png_adler32(1, &filtered[begin], end - begin);
+        }
+
+        free(head);
+        free(prev);
+    }
+
+    free(filtered);
+
+    uint32_t adler = adlers[0];
+    for (int c = 1; c < chunk_count; c++)
+    {
+        size_t chunk_size = c == chunk_count - 1
+                                ? size - (size_t)c * PNG_CHUNK_SIZE
+                                : PNG_CHUNK_SIZE;
+        adler = png_adler32_combine(adler, adlers[c], chunk_size);
+    }
+
+    uint8_t trailer[4];
+    png_put_u32(trailer, adler);
+    png_bits_bytes(&chunks[chunk_count - 1], trailer, sizeof(trailer));
+    free(adlers);
+
+    uint8_t ihdr[13];
+    png_put_u32(&ihdr[0], width);
+    png_put_u32(&ihdr[4], height);
+    static const uint8_t color_types[5] = {0, 0, 4, 2, 6};
+    ihdr[8] = 8; // Bit depth.
+    ihdr[9] = _palette != NULL ? 3 : color_types[comp];
+    ihdr[10] = 0; // Deflate.
+    ihdr[11] = 0; // Adaptive filtering.
+    ihdr[12] = 0; // No interlace.
+
+    uint8_t plte[3 * PNG_MAX_PALETTE];
+    for (int i = 0; _palette != NULL && i < palette_size; i++)
+    {
+        memcpy(&plte[i * 3], &_palette[i], 3);
+    }
+
+    FILE* fp = fopen(_pathname, "wb");
+    bool ok = fp != NULL;
+    if (!ok) perror("error writing image");
+
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    ok = ok && fwrite(signature, 1, sizeof(signature), fp) == sizeof(signature);
+    ok = ok && png_write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    if (_palette != NULL)
+        ok = ok && png_write_chunk(fp, "PLTE", plte, 3 * palette_size);
+
+    for (int c = 0; c < chunk_count; c++)
+    {
+        ok = ok && png_write_chunk(fp, "IDAT", chunks[c].buf, chunks[c].size);
+        free(chunks[c].buf);
+    }
+
+    ok = ok && png_write_chunk(fp, "IEND", NULL, 0);
+    if (fp != NULL) ok = fclose(fp) == 0 && ok;
+
+    free(chunks);
+
+    return ok ? 1 : 0;
+}
+
+// Filters one row into out, behind its filter type byte. Adaptive rows take
+// the filter with the smallest sum of absolute signed outputs, the heuristic
+// the PNG spec suggests, otherwise rows are left unfiltered.
+void png_filter_row(const uint8_t* _row,
+                    const uint8_t* _prev,
+                    int row_bytes,
+                    int bpp,
+                    bool adaptive,
+                    uint8_t* out)
+{
+    int best = 0;
+
+    if (adaptive)
+    {
+        uint64_t cost[5] = {0, 0, 0, 0, 0};
+        for (int x = 0; x < row_bytes; x++)
+        {
+            int a = x >= bpp ? _row[x - bpp] : 0;
+            int b = _prev != NULL ? _prev[x] : 0;
+            int c = x >= bpp && _prev != NULL ? _prev[x - bpp] : 0;
+            int p = a + b - c;
+            int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            int paeth = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            cost[0] += abs((int8_t)_row[x]);
+            cost[1] += abs((int8_t)(_row[x] - a));
+            cost[2] += abs((int8_t)(_row[x] - b));
+            cost[3] += abs((int8_t)(_row[x] - ((a + b) >> 1)));
+            cost[4] += abs((int8_t)(_row[x] - paeth));
+        }
+
+        for (int type = 1; type < 5; type++)
+        {
+            if (cost[type] < cost[best]) best = type;
+        }
+    }
+
+    out[0] = (uint8_t)best;
+    for (int x = 0; x < row_bytes; x++)
+    {
+        int a = x >= bpp ? _row[x - bpp] : 0;
+        int b = _prev != NULL ? _prev[x] : 0;
+        int c = x >= bpp && _prev != NULL ? _prev[x - bpp] : 0;
+        int predict = 0;
+        switch (best)
+        {
+        case 1:
+            predict = a;
+            break;
+        case 2:
+            predict = b;
+            break;
+        case 3:
+            predict = (a + b) >> 1;
+            break;
+        case 4:
+        {
+            int p = a + b - c;
+            int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            predict = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            break;
+        }
+        }
+        out[x + 1] = (uint8_t)(_row[x] - predict);
+    }
+}
+
+// Reverses the low count bits, as deflate sends Huffman codes most
+// significant bit first.
+static inline uint32_t png_reverse(uint32_t code, int count)
+{
+    code = ((code & 0x5555) << 1) | ((code >> 1) & 0x5555);
+    code = ((code & 0x3333) << 2) | ((code >> 2) & 0x3333);
+    code = ((code & 0x0f0f) << 4) | ((code >> 4) & 0x0f0f);
+    code = ((code & 0x00ff) << 8) | ((code >> 8) & 0x00ff);
+    return code >> (16 - count);
+}
+
+// Writes a literal or length symbol with the fixed Huffman code.
+static inline void png_put_symbol(png_bits_t* bits, int symbol)
+{
+    if (symbol < 144)
+        png_bits_put(bits, png_reverse(0x30 + symbol, 8), 8);
+    else if (symbol < 256)
+        png_bits_put(bits, png_reverse(0x190 + symbol - 144, 9), 9);
+    else if (symbol < 280)
+        png_bits_put(bits, png_reverse(symbol - 256, 7), 7);
+    else
+        png_bits_put(bits, png_reverse(0xc0 + symbol - 280, 8), 8);
+}
+
+static inline void png_put_match(png_bits_t* bits, int length, int distance)
+{
+    static const uint16_t length_base[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t distance_base[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static const uint8_t distance_extra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                               3, 3, 4,  4,  5,  5,  6,  6,
+                                               7, 7, 8,  8,  9,  9,  10, 10,
+                                               11, 11, 12, 12, 13, 13};
+
+    int l = 28;
+    while (length_base[l] > length) l--;
+    png_put_symbol(bits, 257 + l);
+    png_bits_put(bits, length - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    png_bits_put(bits, png_reverse(d, 5), 5);
+    png_bits_put(bits, distance - distance_base[d], distance_extra[d]);
+}
+
+static inline uint32_t png_hash(const uint8_t* _data)
+{
+    uint32_t x = _data[0] | (_data[1] << 8) | (_data[2] << 16);
+    return (x * 2654435761u) >> (32 - PNG_HASH_BITS);
+}
+
+// Deflates data[begin, end) into bits, with one fixed Huffman block, and ends
+// on a byte boundary. Matches may reach back into the window before begin,
+// which the decoder already has. Every chunk but the last ends with an empty
+// stored block, a sync flush, so the next chunk can follow it directly.
+// Level 0 writes stored blocks only.
+void png_deflate(png_bits_t* bits,
+                 const uint8_t* _data,
+                 size_t begin,
+                 size_t end,
+                 bool last,
+                 int level,
+                 int32_t* head,
+                 int32_t* prev)
+{
+    if (level == 0)
+    {
+        for (size_t i = begin; i < end; i += PNG_MAX_STORED)
+        {
+            size_t n = end - i < PNG_MAX_STORED ? end - i : PNG_MAX_STORED;
+            uint8_t lengths[4] = {(uint8_t)n,
+                                  (uint8_t)(n >> 8),
+                                  (uint8_t)~n,
+                                  (uint8_t)(~n >> 8)};
+            png_bits_put(bits, last && i + n == end, 1);
+            png_bits_put(bits, 0, 2);
+            png_bits_align(bits);
+            png_bits_bytes(bits, lengths, sizeof(lengths));
+            png_bits_bytes(bits, &_data[i], n);
+        }
+
+        return;
+    }
+
+    static const int max_chain[10] = {
+        0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    static const int nice_length[10] = {
+        0, 8, 16, 32, 64, 128, 128, 258, 258, 258};
+
+    memset(head, 0xff, (1 << PNG_HASH_BITS) * sizeof(int32_t));
+
+    // Positions that have 3 bytes to hash go into the chains, starting with
+    // the window before this chunk.
+    size_t window = begin > PNG_WINDOW_SIZE ? begin - PNG_WINDOW_SIZE : 0;
+    for (size_t i = window; i < begin && i + PNG_MIN_MATCH <= end; i++)
+    {
+        uint32_t h = png_hash(&_data[i]);
+        prev[i % PNG_WINDOW_SIZE] = head[h];
+        head[h] = (int32_t)i;
+    }
+
+    png_bits_put(bits, last, 1);
+    png_bits_put(bits, 1, 2);
+
+    size_t i = begin;
+    while (i < end)
+    {
+        size_t max_length =
+            end - i < PNG_MAX_MATCH ? end - i : (size_t)PNG_MAX_MATCH;
+        size_t best_length = 0;
+        size_t best_distance = 0;
+
+        if (max_length >= PNG_MIN_MATCH)
+        {
+            uint32_t h = png_hash(&_data[i]);
+            int32_t candidate = head[h];
+            int chain = max_chain[level];
+
+            while (candidate >= 0 && i - candidate <= PNG_WINDOW_SIZE &&
+                   chain-- > 0)
+            {
+                const uint8_t* a = &_data[candidate];
+                const uint8_t* b = &_data[i];
+                if (a[best_length] == b[best_length])
+                {
+                    size_t length = 0;
+                    while (length < max_length && a[length] == b[length])
+                        length++;
+
+                    if (length > best_length)
+                    {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length == max_length ||
+                            length >= (size_t)nice_length[level])
+                            break;
+                    }
+                }
+
+                // Older positions overwritten by newer ones end the chain.
+                int32_t next = prev[candidate % PNG_WINDOW_SIZE];
+                if (next >= candidate) break;
+                candidate = next;
+            }
+
+            prev[i % PNG_WINDOW_SIZE] = head[h];
+            head[h] = (int32_t)i;
+        }
+
+        if (best_length >= PNG_MIN_MATCH)
+        {
+            png_put_match(bits, (int)best_length, (int)best_distance);
+
+            for (size_t j = i + 1; j < i + best_length; j++)
+            {
+                if (j + PNG_MIN_MATCH > end) break;
+                uint32_t h = png_hash(&_data[j]);
+                prev[j % PNG_WINDOW_SIZE] = head[h];
+                head[h] = (int32_t)j;
+            }
+
+            i += best_length;
+        }
+        else
+        {
+            png_put_symbol(bits, _data[i]);
+            i++;
+        }
+    }
+
+    png_put_symbol(bits, 256);
+
+    if (!last)
+    {
+        static const uint8_t flush[4] = {0x00, 0x00, 0xff, 0xff};
+        png_bits_put(bits, 0, 3);
+        png_bits_align(bits);
+        png_bits_bytes(bits, flush, sizeof(flush));
+    }
+
+    png_bits_align(bits);
+}
+
+void png_bits_put(png_bits_t* bits, uint32_t value, int count)
+{
+    bits->acc |= (uint64_t)value << bits->count;
+    bits->count += count;
+
+    while (bits->count >= 8)
+    {
+        if (bits->size == bits->cap)
+        {
+            bits->cap *= 2;
+            bits->buf = (uint8_t*)realloc(bits->buf, bits->cap);
+        }
+
+        bits->buf[bits->size++] = (uint8_t)bits->acc;
+        bits->acc >>= 8;
+        bits->count -= 8;
+    }
+}
+
+// Pads the last byte with zero bits.
+void png_bits_align(png_bits_t* bits)
+{
+    if (bits->count > 0) png_bits_put(bits, 0, 8 - bits->count);
+}
+
+// Appends whole bytes, the bits must be byte aligned.
+void png_bits_bytes(png_bits_t* bits, const uint8_t* _data, size_t size)
+{
+    assert(bits->count == 0);
+
+    while (bits->size + size > bits->cap)
+    {
+        bits->cap *= 2;
+        bits->buf = (uint8_t*)realloc(bits->buf, bits->cap);
+    }
+
+    memcpy(&bits->buf[bits->size], _data, size);
+    bits->size += size;
+}
+
+// Adler-32 as used by zlib. Pass 1 to start a new checksum.
+uint32_t png_adler32(uint32_t adler, const uint8_t* _data, size_t size)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+
+    // 5552 bytes is the most that can be summed before b overflows.
+    while (size > 0)
+    {
+        size_t n = size < 5552 ? size : 5552;
+        size -= n;
+        while (n-- > 0)
+        {
+            a += *_data++;
+            b += a;
+        }
+        a %= PNG_ADLER_BASE;
+        b %= PNG_ADLER_BASE;
+    }
+
+    return (b << 16) | a;
+}
+
+// Returns the Adler-32 of two concatenated buffers from their own checksums,
+// and the size of the second one.
+uint32_t png_adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    uint32_t rem = (uint32_t)(size2 % PNG_ADLER_BASE);
+    uint32_t a = adler1 & 0xffff;
+    uint32_t b = (uint32_t)(((uint64_t)rem * a) % PNG_ADLER_BASE);
+
+    a += (adler2 & 0xffff) + PNG_ADLER_BASE - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + PNG_ADLER_BASE - rem;
+    if (a >= PNG_ADLER_BASE) a -= PNG_ADLER_BASE;
+    if (a >= PNG_ADLER_BASE) a -= PNG_ADLER_BASE;
+    if (b >= 2 * PNG_ADLER_BASE) b -= 2 * PNG_ADLER_BASE;
+    if (b >= PNG_ADLER_BASE) b -= PNG_ADLER_BASE;
+
+    return (b << 16) | a;
+}
+
+// CRC-32 as used by PNG chunks. Pass 0 to start a new checksum.
+uint32_t png_crc32(uint32_t crc, const uint8_t* _data, size_t size)
+{
+    static uint32_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ _data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+// Writes the length, type, data and CRC of one chunk.
+bool png_write_chunk(FILE* fp,
+                     const char* _type,
+                     const uint8_t* _data,
+                     uint32_t size)
+{
+    uint8_t header[8];
+    png_put_u32(&header[0], size);
+    memcpy(&header[4], _type, 4);
+
+    uint32_t crc = png_crc32(0, &header[4], 4);
+    if (size > 0) crc = png_crc32(crc, _data, size);
+
+    uint8_t footer[4];
+    png_put_u32(footer, crc);
+
+    return fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+           (size == 0 || fwrite(_data, 1, size, fp) == size) &&
+           fwrite(footer, 1, sizeof(footer), fp) == sizeof(footer);
+}
+
+// PNG integers are big endian.
+void png_put_u32(uint8_t* buf, uint32_t val)
+{
+    buf[0] = (uint8_t)(val >> 24);
+    buf[1] = (uint8_t)(val >> 16);
+    buf[2] = (uint8_t)(val >> 8);
+    buf[3] = (uint8_t)val;
+}
@@ -0,0 +1,752 @@
+#pragma once
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Centroids are padded to a multiple of this, so the widest variant never
+// needs a tail loop.
+#define SIMD_WIDTH 16
+// Distances and centroid indices are packed into one key as
+// (distance << SIMD_INDEX_BITS) | index, so a plain min finds the nearest
+// centroid, and on ties the one with the lowest index.
+#define SIMD_INDEX_BITS 10
+#define SIMD_INDEX_MASK ((1 << SIMD_INDEX_BITS) - 1)
+// Padding centroids sit at this value in every channel, which is farther from
+// any pixel than any real centroid can be, while keys still fit in an int.
+#define SIMD_PAD_VALUE 512
+
+// Largest centroid count the labels can hold. Labels take one byte per pixel
+// up to 256 centroids, and two bytes above that. SIMD_INDEX_BITS caps k at
+// 1024 either way.
+#ifndef SIMD_MAX_K
+#define SIMD_MAX_K 256
+#endif
+
+#if SIMD_MAX_K <= 256
+typedef uint8_t simd_label_t;
+#define SIMD_LABEL_CL_TYPE "uchar"
+#else
+typedef uint16_t simd_label_t;
+#define SIMD_LABEL_CL_TYPE "ushort"
+#endif
+
+typedef enum simd_isa_t
+{
+    SIMD_ISA_AUTO,
+    SIMD_ISA_SCALAR,
+    SIMD_ISA_SSE42,
+    SIMD_ISA_AVX2,
+    SIMD_ISA_AVX512,
+} simd_isa_t;
+
+// Centroids as separate channel arrays, aligned for vector loads.
+typedef struct simd_centroids_t
+{
+    int k;
+    int k_padded;
+    int32_t* r;
+    int32_t* g;
+    int32_t* b;
+} simd_centroids_t;
+
+typedef uint64_t (*simd_assign_fn)(const simd_centroids_t* soa,
+                                   const uint8_t* data,
+                                   int comp,
+                                   int begin,
+                                   int end,
+                                   simd_label_t* labels,
+                                   bool first);
+typedef uint64_t (*simd_assign_accumulate_fn)(const simd_centroids_t* soa,
+                                              const uint8_t* data,
+                                              int comp,
+                                              int begin,
+                                              int end,
+                                              simd_label_t* labels,
+                                              bool first,
+                                              uint64_t* group_size,
+                                              uint64_t* rgb_values);
+typedef void (*simd_map_fn)(const uint32_t* palette,
+                            const simd_label_t* labels,
+                            int begin,
+                            int end,
+                            uint32_t* out);
+
+// The kernel variants in use, picked once at startup by simd_select.
+typedef struct simd_kernels_t
+{
+    simd_isa_t isa;
+    simd_assign_fn assign;
+    simd_assign_accumulate_fn assign_accumulate;
+    simd_map_fn map;
+} simd_kernels_t;
+
+simd_isa_t simd_select(simd_isa_t isa);
+bool simd_isa_supported(simd_isa_t isa);
+simd_centroids_t* simd_centroids_init(simd_centroids_t** soa, int k);
+simd_centroids_t* simd_centroids_load(simd_centroids_t** soa, const int* rgb);
+uint64_t simd_assign(const simd_centroids_t* soa,
+                     const uint8_t* data,
+                     int comp,
+                     int begin,
+                     int end,
+                     simd_label_t* labels,
+                     bool first);
+uint64_t simd_assign_accumulate(const simd_centroids_t* soa,
+                                const uint8_t* data,
+                                int comp,
+                                int begin,
+                                int end,
+                                simd_label_t* labels,
+                                bool first,
+                                uint64_t* group_size,
+                                uint64_t* rgb_values);
+void simd_map(const uint32_t* palette,
+              const simd_label_t* labels,
+              int begin,
+              int end,
+              uint32_t* out);
+int simd_isa_parse(const char* _name);
+const char* simd_isa_name(simd_isa_t isa);
+void simd_centroids_free(simd_centroids_t** soa);
+static uint64_t simd_assign_scalar(const simd_centroids_t* soa,
+                                   const uint8_t* data,
+                                   int comp,
+                                   int begin,
+                                   int end,
+                                   simd_label_t* labels,
+                                   bool first);
+static uint64_t simd_assign_accumulate_scalar(const simd_centroids_t* soa,
+                                              const uint8_t* data,
+                                              int comp,
+                                              int begin,
+                                              int end,
+                                              simd_label_t* labels,
+                                              bool first,
+                                              uint64_t* group_size,
+                                              uint64_t* rgb_values);
+static void simd_map_scalar(const uint32_t* palette,
+                            const simd_label_t* labels,
+                            int begin,
+                            int end,
+                            uint32_t* out);
+
+static simd_kernels_t simd_kernels = {SIMD_ISA_SCALAR,
+                                      simd_assign_scalar,
+                                      simd_assign_accumulate_scalar,
+                                      simd_map_scalar};
+
+// Shared bodies of the kernels. They are inlined into each variant together
+// with its nearest-centroid search, so the compiler can use that variant's
+// instructions throughout.
+typedef int (*simd_nearest_fn)(const simd_centroids_t* soa,
+                               int r,
+                               int g,
+                               int b);
+
+static inline __attribute__((always_inline)) uint64_t
+simd_assign_body(const simd_centroids_t* soa,
+                 const uint8_t* data,
+                 int comp,
+                 int begin,
+                 int end,
+                 simd_label_t* labels,
+                 bool first,
+                 simd_nearest_fn nearest)
+{
+    uint64_t changed = 0;
+    for (int i = begin; i < end; i++)
+    {
+        const uint8_t* px = data + i * comp;
+        int group = nearest(soa, px[0], px[1], px[2]);
+        changed += first || labels[i] != group;
+        labels[i] = group;
+    }
+
+    return changed;
+}
+
+// Assigns and accumulates in the same pass, so each pixel is read once.
+static inline __attribute__((always_inline)) uint64_t
+simd_assign_accumulate_body(const simd_centroids_t* soa,
+                            const uint8_t* data,
+                            int comp,
+                            int begin,
+                            int end,
+                            simd_label_t* labels,
+                            bool first,
+                            uint64_t* group_size,
+                            uint64_t* rgb_values,
+                            simd_nearest_fn nearest)
+{
+    uint64_t changed = 0;
+    for (int i = begin; i < end; i++)
+    {
+        const uint8_t* px = data + i * comp;
+        int group = nearest(soa, px[0], px[1], px[2]);
+        changed += first || labels[i] != group;
+        labels[i] = group;
+
+        group_size[group]++;
+        rgb_values[group * 3 + 0] += px[0];
+        rgb_values[group * 3 + 1] += px[1];
+        rgb_values[group * 3 + 2] += px[2];
+    }
+
+    return changed;
+}
+
+static inline __attribute__((always_inline)) void
+simd_map_body(const uint32_t* palette,
+              const simd_label_t* labels,
+              int begin,
+              int end,
+              uint32_t* out)
+{
+    for (int i = begin; i < end; i++)
+    {
+        out[i] = palette[labels[i]];
+    }
+}
+
+static inline int simd_nearest_scalar(const simd_centroids_t* soa,
+                                      int r,
+                                      int g,
+                                      int b)
+{
+    int best = INT_MAX;
+    for (int c = 0; c < soa->k; c++)
+    {
+        int dr = soa->r[c] - r;
+        int dg = soa->g[c] - g;
+        int db = soa->b[c] - b;
+        int key = (dr * dr + dg * dg + db * db) << SIMD_INDEX_BITS | c;
+        best = key < best ? key : best;
+    }
+
+    return best & SIMD_INDEX_MASK;
+}
+
+static uint64_t simd_assign_scalar(const simd_centroids_t* soa,
+                                   const uint8_t* data,
+                                   int comp,
+                                   int begin,
+                                   int end,
+                                   simd_label_t* labels,
+                                   bool first)
+{
+    return simd_assign_body(
+        soa, data, comp, begin, end, labels, first, simd_nearest_scalar);
+}
+
+static uint64_t simd_assign_accumulate_scalar(const simd_centroids_t* soa,
+                                              const uint8_t* data,
+                                              int comp,
+                                              int begin,
+                                              int end,
+                                              simd_label_t* labels,
+                                              bool first,
+                                              uint64_t* group_size,
+                                              uint64_t* rgb_values)
+{
+    return simd_assign_accumulate_body(soa,
+                                       data,
+                                       comp,
+                                       begin,
+                                       end,
+                                       labels,
+                                       first,
+                                       group_size,
+                                       rgb_values,
+                                       simd_nearest_scalar);
+}
+
+static void simd_map_scalar(const uint32_t* palette,
+                            const simd_label_t* labels,
+                            int begin,
+                            int end,
+                            uint32_t* out)
+{
+    simd_map_body(palette, labels, begin, end, out);
+}
+
+#if defined(SIMD_X86)
+
+__attribute__((target("sse4.2"))) static inline int
+simd_nearest_sse42(const simd_centroids_t* soa,
+                   int r,
+                   int g,
+                   int b)
+{
+    const __m128i pr = _mm_set1_epi32(r);
+    const __m128i pg = _mm_set1_epi32(g);
+    const __m128i pb = _mm_set1_epi32(b);
+    const __m128i step = _mm_set1_epi32(4);
+
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i best = _mm_set1_epi32(INT_MAX);
+    for (int c = 0; c < soa->k_padded; c += 4)
+    {
+        __m128i dr =
+            _mm_sub_epi32(_mm_load_si128((const __m128i*)(soa->r + c)), pr);
+        __m128i dg =
+            _mm_sub_epi32(_mm_load_si128((const __m128i*)(soa->g + c)), pg);
+        __m128i db =
+            _mm_sub_epi32(_mm_load_si128((const __m128i*)(soa->b + c)), pb);
+        __m128i d = _mm_add_epi32(
+            _mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)),
+            _mm_mullo_epi32(db, db));
+        __m128i key = _mm_or_si128(_mm_slli_epi32(d, SIMD_INDEX_BITS), idx);
+        best = _mm_min_epi32(best, key);
+        idx = _mm_add_epi32(idx, step);
+    }
+
+    best = _mm_min_epi32(best,
+                         _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    best = _mm_min_epi32(best,
+                         _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(best) & SIMD_INDEX_MASK;
+}
+
+__attribute__((target("sse4.2"))) static uint64_t
+simd_assign_sse42(const simd_centroids_t* soa,
+                  const uint8_t* data,
+                  int comp,
+                  int begin,
+                  int end,
+                  simd_label_t* labels,
+                  bool first)
+{
+    return simd_assign_body(
+        soa, data, comp, begin, end, labels, first, simd_nearest_sse42);
+}
+
+__attribute__((target("sse4.2"))) static uint64_t
+simd_assign_accumulate_sse42(const simd_centroids_t* soa,
+                             const uint8_t* data,
+                             int comp,
+                             int begin,
+                             int end,
+                             simd_label_t* labels,
+                             bool first,
+                             uint64_t* group_size,
+                             uint64_t* rgb_values)
+{
+    return simd_assign_accumulate_body(soa,
+                                       data,
+                                       comp,
+                                       begin,
+                                       end,
+                                       labels,
+                                       first,
+                                       group_size,
+                                       rgb_values,
+                                       simd_nearest_sse42);
+}
+
+__attribute__((target("sse4.2"))) static void
+simd_map_sse42(const uint32_t* palette,
+               const simd_label_t* labels,
+               int begin,
+               int end,
+               uint32_t* out)
+{
+    simd_map_body(palette, labels, begin, end, out);
+}
+
+__attribute__((target("avx2"))) static inline int
+simd_nearest_avx2(const simd_centroids_t* soa,
+                  int r,
+                  int g,
+                  int b)
+{
+    const __m256i pr = _mm256_set1_epi32(r);
+    const __m256i pg = _mm256_set1_epi32(g);
+    const __m256i pb = _mm256_set1_epi32(b);
+    const __m256i step = _mm256_set1_epi32(8);
+
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i best = _mm256_set1_epi32(INT_MAX);
+    for (int c = 0; c < soa->k_padded; c += 8)
+    {
+        __m256i dr = _mm256_sub_epi32(
+            _mm256_load_si256((const __m256i*)(soa->r + c)), pr);
+        __m256i dg = _mm256_sub_epi32(
+            _mm256_load_si256((const __m256i*)(soa->g + c)), pg);
+        __m256i db = _mm256_sub_epi32(
+            _mm256_load_si256((const __m256i*)(soa->b + c)), pb);
+        __m256i d = _mm256_add_epi32(
+            _mm256_add_epi32(_mm256_mullo_epi32(dr, dr),
+                             _mm256_mullo_epi32(dg, dg)),
+            _mm256_mullo_epi32(db, db));
+        __m256i key =
+            _mm256_or_si256(_mm256_slli_epi32(d, SIMD_INDEX_BITS), idx);
+        best = _mm256_min_epi32(best, key);
+        idx = _mm256_add_epi32(idx, step);
+    }
+
+    __m128i m = _mm_min_epi32(_mm256_castsi256_si128(best),
+                              _mm256_extracti128_si256(best, 1));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(m) & SIMD_INDEX_MASK;
+}
+
+__attribute__((target("avx2"))) static uint64_t
+simd_assign_avx2(const simd_centroids_t* soa,
+                 const uint8_t* data,
+                 int comp,
+                 int begin,
+                 int end,
+                 simd_label_t* labels,
+                 bool first)
+{
+    return simd_assign_body(
+        soa, data, comp, begin, end, labels, first, simd_nearest_avx2);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+simd_assign_accumulate_avx2(const simd_centroids_t* soa,
+                            const uint8_t* data,
+                            int comp,
+                            int begin,
+                            int end,
+                            simd_label_t* labels,
+                            bool first,
+                            uint64_t* group_size,
+                            uint64_t* rgb_values)
+{
+    return simd_assign_accumulate_body(soa,
+                                       data,
+                                       comp,
+                                       begin,
+                                       end,
+                                       labels,
+                                       first,
+                                       group_size,
+                                       rgb_values,
+                                       simd_nearest_avx2);
+}
+
+__attribute__((target("avx2"))) static void
+simd_map_avx2(const uint32_t* palette,
+              const simd_label_t* labels,
+              int begin,
+              int end,
+              uint32_t* out)
+{
+    // Every output pixel is one palette entry, so eight are gathered at once,
+    // with the labels widened to 32-bit indices first.
+    int i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+#if SIMD_MAX_K <= 256
+        __m256i idx = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)(labels + i)));
+#else
+        __m256i idx = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)(labels + i)));
+#endif
+        __m256i px = _mm256_i32gather_epi32((const int*)palette, idx, 4);
+        _mm256_storeu_si256((__m256i*)(out + i), px);
+    }
+
+    simd_map_body(palette, labels, i, end, out);
+}
+
+__attribute__((target("avx512f"))) static inline int
+simd_nearest_avx512(const simd_centroids_t* soa,
+                    int r,
+                    int g,
+                    int b)
+{
+    const __m512i pr = _mm512_set1_epi32(r);
+    const __m512i pg = _mm512_set1_epi32(g);
+    const __m512i pb = _mm512_set1_epi32(b);
+    const __m512i step = _mm512_set1_epi32(16);
+
+    __m512i idx =
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i best = _mm512_set1_epi32(INT_MAX);
+    for (int c = 0; c < soa->k_padded; c += 16)
+    {
+        __m512i dr = _mm512_sub_epi32(_mm512_load_si512(soa->r + c), pr);
+        __m512i dg = _mm512_sub_epi32(_mm512_load_si512(soa->g + c), pg);
+        __m512i db = _mm512_sub_epi32(_mm512_load_si512(soa->b + c), pb);
+        __m512i d = _mm512_add_epi32(
+            _mm512_add_epi32(_mm512_mullo_epi32(dr, dr),
+                             _mm512_mullo_epi32(dg, dg)),
+            _mm512_mullo_epi32(db, db));
+        __m512i key =
+            _mm512_or_si512(_mm512_slli_epi32(d, SIMD_INDEX_BITS), idx);
+        best = _mm512_min_epi32(best, key);
+        idx = _mm512_add_epi32(idx, step);
+    }
+
+    return _mm512_reduce_min_epi32(best) & SIMD_INDEX_MASK;
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+simd_assign_avx512(const simd_centroids_t* soa,
+                   const uint8_t* data,
+                   int comp,
+                   int begin,
+                   int end,
+                   simd_label_t* labels,
+                   bool first)
+{
+    return simd_assign_body(
+        soa, data, comp, begin, end, labels, first, simd_nearest_avx512);
+}
+
+__attribute__((target("avx512f"))) static uint64_t
+simd_assign_accumulate_avx512(const simd_centroids_t* soa,
+                              const uint8_t* data,
+                              int comp,
+                              int begin,
+                              int end,
+                              simd_label_t* labels,
+                              bool first,
+                              uint64_t* group_size,
+                              uint64_t* rgb_values)
+{
+    return simd_assign_accumulate_body(soa,
+                                       data,
+                                       comp,
+                                       begin,
+                                       end,
+                                       labels,
+                                       first,
+                                       group_size,
+                                       rgb_values,
+                                       simd_nearest_avx512);
+}
+
+__attribute__((target("avx512f"))) static void
+simd_map_avx512(const uint32_t* palette,
+                const simd_label_t* labels,
+                int begin,
+                int end,
+                uint32_t* out)
+{
+    int i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+#if SIMD_MAX_K <= 256
+        __m512i idx = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)(labels + i)));
+#else
+        __m512i idx = _mm512_cvtepu16_epi32(
+            _mm256_loadu_si256((const __m256i*)(labels + i)));
+#endif
+        __m512i px = _mm512_i32gather_epi32(idx, palette, 4);
+        _mm512_storeu_si512(out + i, px);
+    }
+
+    simd_map_body(palette, labels, i, end, out);
+}
+
+#endif
+
+simd_isa_t simd_select(simd_isa_t isa)
+{
+    if (isa == SIMD_ISA_AUTO)
+    {
+        isa = SIMD_ISA_AVX512;
+        while (!simd_isa_supported(isa)) isa = (simd_isa_t)(isa - 1);
+    }
+    else if (!simd_isa_supported(isa))
+    {
+        fprintf(stderr,
+                "%s kernels are not supported on this cpu, using scalar\n",
+                simd_isa_name(isa));
+        isa = SIMD_ISA_SCALAR;
+    }
+
+    simd_kernels.isa = isa;
+    switch (isa)
+    {
+#if defined(SIMD_X86)
+    case SIMD_ISA_SSE42:
+        simd_kernels.assign = simd_assign_sse42;
+        simd_kernels.assign_accumulate = simd_assign_accumulate_sse42;
+        simd_kernels.map = simd_map_sse42;
+        break;
+    case SIMD_ISA_AVX2:
+        simd_kernels.assign = simd_assign_avx2;
+        simd_kernels.assign_accumulate = simd_assign_accumulate_avx2;
+        simd_kernels.map = simd_map_avx2;
+        break;
+    case SIMD_ISA_AVX512:
+        simd_kernels.assign = simd_assign_avx512;
+        simd_kernels.assign_accumulate = simd_assign_accumulate_avx512;
+        simd_kernels.map = simd_map_avx512;
+        break;
+#endif
+    default:
+        simd_kernels.assign = simd_assign_scalar;
+        simd_kernels.assign_accumulate = simd_assign_accumulate_scalar;
+        simd_kernels.map = simd_map_scalar;
+        break;
+    }
+
+    printf("using %s kernels\n", simd_isa_name(isa));
+
+    return isa;
+}
+
+bool simd_isa_supported(simd_isa_t isa)
+{
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    switch (isa)
+    {
+    case SIMD_ISA_SCALAR:
+        return true;
+    case SIMD_ISA_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case SIMD_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SIMD_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return false;
+    }
+#else
+    return isa == SIMD_ISA_SCALAR;
+#endif
+}
+
+simd_centroids_t* simd_centroids_init(simd_centroids_t** soa, int k)
+{
+    assert(k > 0 && k <= (1 << SIMD_INDEX_BITS));
+
+    if (*soa == NULL)
+    {
+        *soa = (simd_centroids_t*)realloc(*soa, sizeof(simd_centroids_t));
+    }
+
+    (*soa)->k = k;
+    (*soa)->k_padded = (k + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+
+    size_t size = (*soa)->k_padded * sizeof(int32_t);
+    (*soa)->r = (int32_t*)aligned_alloc(64, size);
+    (*soa)->g = (int32_t*)aligned_alloc(64, size);
+    (*soa)->b = (int32_t*)aligned_alloc(64, size);
+
+    for (int c = k; c < (*soa)->k_padded; c++)
+    {
+        (*soa)->r[c] = SIMD_PAD_VALUE;
+        (*soa)->g[c] = SIMD_PAD_VALUE;
+        (*soa)->b[c] = SIMD_PAD_VALUE;
+    }
+
+    return (*soa);
+}
+
+simd_centroids_t* simd_centroids_load(simd_centroids_t** soa, const int* rgb)
+{
+    assert(*soa != NULL);
+    assert(rgb != NULL);
+
+    for (int c = 0; c < (*soa)->k; c++)
+    {
+        (*soa)->r[c] = rgb[c * 3 + 0];
+        (*soa)->g[c] = rgb[c * 3 + 1];
+        (*soa)->b[c] = rgb[c * 3 + 2];
+    }
+
+    return (*soa);
+}
+
+// Labels pixels [begin, end) with their nearest centroid, and returns how many
+// labels changed. On the first iteration every label counts as changed.
+uint64_t simd_assign(const simd_centroids_t* soa,
+                     const uint8_t* data,
+                     int comp,
+                     int begin,
+                     int end,
+                     simd_label_t* labels,
+                     bool first)
+{
+    return simd_kernels.assign(soa, data, comp, begin, end, labels, first);
+}
+
+// Labels pixels [begin, end) like simd_assign, and adds each pixel to the
+// count and channel sums of its new cluster.
+uint64_t simd_assign_accumulate(const simd_centroids_t* soa,
+                                const uint8_t* data,
+                                int comp,
+                                int begin,
+                                int end,
+                                simd_label_t* labels,
+                                bool first,
+                                uint64_t* group_size,
+                                uint64_t* rgb_values)
+{
+    return simd_kernels.assign_accumulate(
+        soa, data, comp, begin, end, labels, first, group_size, rgb_values);
+}
+
+// Writes the palette entry of each pixel in [begin, end) to out.
+void simd_map(const uint32_t* palette,
+              const simd_label_t* labels,
+              int begin,
+              int end,
+              uint32_t* out)
+{
+    simd_kernels.map(palette, labels, begin, end, out);
+}
+
+int simd_isa_parse(const char* _name)
+{
+    assert(_name != NULL);
+
+    if (strcmp(_name, "auto") == 0) return SIMD_ISA_AUTO;
+    if (strcmp(_name, "scalar") == 0) return SIMD_ISA_SCALAR;
+    if (strcmp(_name, "sse4.2") == 0) return SIMD_ISA_SSE42;
+    if (strcmp(_name, "avx2") == 0) return SIMD_ISA_AVX2;
+    if (strcmp(_name, "avx512") == 0) return SIMD_ISA_AVX512;
+
+    return -1;
+}
+
+const char* simd_isa_name(simd_isa_t isa)
+{
+    switch (isa)
+    {
+    case SIMD_ISA_AUTO:
+        return "auto";
+    case SIMD_ISA_SCALAR:
+        return "scalar";
+    case SIMD_ISA_SSE42:
+        return "sse4.2";
+    case SIMD_ISA_AVX2:
+        return "avx2";
+    case SIMD_ISA_AVX512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
+
+void simd_centroids_free(simd_centroids_t** soa)
+{
+    assert(*soa != NULL);
+
+    free((*soa)->r);
+    free((*soa)->g);
+    free((*soa)->b);
+    free(*soa);
+}